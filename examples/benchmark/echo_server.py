@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""
+Echo and flood server for the websocket benchmark (see README.md).
+Only uses the Python standard library.
+
+    python3 echo_server.py [--port 9001] [--cert cert.pem --key key.pem]
+
+  ws://host:port/          echoes every message back, with the same opcode
+  ws://host:port/flood?size=N&count=M
+                           sends M binary messages of N bytes, as fast as the client reads them
+"""
+
+import argparse
+import asyncio
+import base64
+import hashlib
+import ssl
+import struct
+from urllib.parse import urlparse, parse_qs
+
+GUID = b"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+OP_CONTINUATION, OP_TEXT, OP_BINARY, OP_CLOSE, OP_PING, OP_PONG = 0x0, 0x1, 0x2, 0x8, 0x9, 0xA
+
+
+async def handshake(reader, writer):
+    request = await reader.readuntil(b"\r\n\r\n")
+    lines = request.decode("latin-1").split("\r\n")
+    path = lines[0].split(" ")[1]
+    headers = {}
+    for line in lines[1:]:
+        if ":" in line:
+            name, value = line.split(":", 1)
+            headers[name.strip().lower()] = value.strip()
+
+    accept = base64.b64encode(hashlib.sha1(headers["sec-websocket-key"].encode() + GUID).digest())
+    response = (b"HTTP/1.1 101 Switching Protocols\r\n"
+                b"Upgrade: websocket\r\n"
+                b"Connection: Upgrade\r\n"
+                b"Sec-WebSocket-Accept: " + accept + b"\r\n")
+    if "sec-websocket-protocol" in headers:
+        response += b"Sec-WebSocket-Protocol: " + headers["sec-websocket-protocol"].split(",")[0].strip().encode() + b"\r\n"
+    writer.write(response + b"\r\n")
+    await writer.drain()
+    return path
+
+
+async def read_frame(reader):
+    b0, b1 = await reader.readexactly(2)
+    length = b1 & 0x7F
+    if length == 126:
+        length, = struct.unpack("!H", await reader.readexactly(2))
+    elif length == 127:
+        length, = struct.unpack("!Q", await reader.readexactly(8))
+    mask = await reader.readexactly(4) if b1 & 0x80 else None
+    payload = await reader.readexactly(length)
+    if mask:
+        # Unmask a word at a time, python loops over bytes are slow
+        count = (length + 3) // 4
+        key = int.from_bytes(mask * count, "little")
+        padded = payload + b"\0" * (count * 4 - length)
+        payload = (int.from_bytes(padded, "little") ^ key).to_bytes(count * 4, "little")[:length]
+    return b0 & 0x80, b0 & 0x0F, payload
+
+
+def frame(opcode, payload):
+    length = len(payload)
+    if length < 126:
+        header = struct.pack("!BB", 0x80 | opcode, length)
+    elif length < 65536:
+        header = struct.pack("!BBH", 0x80 | opcode, 126, length)
+    else:
+        header = struct.pack("!BBQ", 0x80 | opcode, 127, length)
+    return header + payload
+
+
+async def read_message(reader, writer):
+    """Returns (opcode, payload), and answers pings along the way. Returns None on close."""
+    message_opcode, parts = None, []
+    while True:
+        fin, opcode, payload = await read_frame(reader)
+        if opcode == OP_CLOSE:
+            writer.write(frame(OP_CLOSE, payload[:2]))
+            await writer.drain()
+            return None
+        if opcode == OP_PING:
+            writer.write(frame(OP_PONG, payload))
+            continue
+        if opcode == OP_PONG:
+            continue
+        if opcode != OP_CONTINUATION:
+            message_opcode = opcode
+        parts.append(payload)
+        if fin:
+            return message_opcode, b"".join(parts)
+
+
+async def echo(reader, writer):
+    while True:
+        message = await read_message(reader, writer)
+        if message is None:
+            return
+        writer.write(frame(*message))
+        await writer.drain()
+
+
+async def flood(reader, writer, size, count):
+    payload = frame(OP_BINARY, b"x" * size)
+    for _ in range(count):
+        writer.write(payload)
+        await writer.drain()
+    while await read_message(reader, writer) is not None:
+        pass
+
+
+async def handle(reader, writer):
+    try:
+        url = urlparse(await handshake(reader, writer))
+        if url.path.rstrip("/") == "/flood":
+            query = parse_qs(url.query)
+            await flood(reader, writer, int(query.get("size", ["64"])[0]), int(query.get("count", ["10000"])[0]))
+        else:
+            await echo(reader, writer)
+    except (asyncio.IncompleteReadError, ConnectionError, KeyError):
+        pass
+    finally:
+        writer.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=9001)
+    parser.add_argument("--cert", help="certificate (pem) to serve wss")
+    parser.add_argument("--key", help="private key (pem) of the certificate")
+    args = parser.parse_args()
+
+    context = None
+    if args.cert:
+        context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+        context.load_cert_chain(args.cert, args.key)
+
+    async def serve():
+        server = await asyncio.start_server(handle, args.host, args.port, ssl=context, limit=1 << 24)
+        print("Serving %s://%s:%d" % ("wss" if context else "ws", args.host, args.port))
+        async with server:
+            await server.serve_forever()
+
+    asyncio.run(serve())
+
+
+if __name__ == "__main__":
+    main()
@@ -254,6 +254,26 @@ ssize_t wslay_frame_send(wslay_frame_context_ptr ctx,
 ssize_t wslay_frame_recv(wslay_frame_context_ptr ctx,
                          struct wslay_frame_iocb *iocb);
 
+/*
+ * Resizes the buffer that frames are read into. The bytes that are
+ * already in the buffer are kept, so the new size must be able to
+ * hold them, and at least 14 bytes, which is the longest frame
+ * header. Returns 0 on success, WSLAY_ERR_INVALID_ARGUMENT if the
+ * size is too small, or WSLAY_ERR_NOMEM.
+ */
+int wslay_frame_set_recv_buffer_size(wslay_frame_context_ptr ctx,
+                                     size_t size);
+
+/*
+ * Sets a buffer for the next wslay_frame_recv() call. If that call
+ * reads frame payload, and none is left in the frame buffer, it reads
+ * at most len bytes straight into buf, and points iocb->data there.
+ * The buffer is only used by the next call, whether it reads into it
+ * or not.
+ */
+void wslay_frame_set_payload_buffer(wslay_frame_context_ptr ctx,
+                                    uint8_t *buf, size_t len);
+
 struct wslay_event_context;
 /* Pointer to the event-based API context */
 typedef struct wslay_event_context *wslay_event_context_ptr;
@@ -375,6 +395,23 @@ typedef int (*wslay_event_genmask_callback)(wslay_event_context_ptr ctx,
                                             uint8_t *buf, size_t len,
                                             void *user_data);
 
+/*
+ * Callback function invoked by wslay_event_recv() before it reads more
+ * payload of a non-control frame from peer, when the frame payload
+ * buffer is empty. len is the number of payload bytes still to come
+ * in the current frame. The implementation may return a buffer, and
+ * store its size in *buflen. Then the payload is read straight into
+ * it with wslay_event_recv_callback, instead of going through the
+ * frame payload buffer, and passed to
+ * wslay_event_on_frame_recv_chunk_callback at that address. Return
+ * NULL to read through the frame payload buffer.
+ *
+ * This callback is only used if buffering is disabled with
+ * wslay_event_config_set_no_buffering().
+ */
+typedef uint8_t *(*wslay_event_recv_payload_buffer_callback)
+(wslay_event_context_ptr ctx, uint64_t len, size_t *buflen, void *user_data);
+
 struct wslay_event_callbacks {
   wslay_event_recv_callback recv_callback;
   wslay_event_send_callback send_callback;
@@ -383,6 +420,7 @@ struct wslay_event_callbacks {
   wslay_event_on_frame_recv_chunk_callback on_frame_recv_chunk_callback;
   wslay_event_on_frame_recv_end_callback on_frame_recv_end_callback;
   wslay_event_on_msg_recv_callback on_msg_recv_callback;
+  wslay_event_recv_payload_buffer_callback recv_payload_buffer_callback;
 };
 
 /*
@@ -444,6 +482,41 @@ void wslay_event_config_set_allowed_rsv_bits(wslay_event_context_ptr ctx,
  */
 void wslay_event_config_set_no_buffering(wslay_event_context_ptr ctx, int val);
 
+/*
+ * Frees the blocks the context keeps for reuse. Blocks in use, such
+ * as queued messages, are not affected, and the context keeps
+ * recycling blocks afterwards.
+ */
+void wslay_event_trim_pool(wslay_event_context_ptr ctx);
+
+/*
+ * Returns 1 if data is complete, valid UTF-8, otherwise 0. Text
+ * messages are validated as they are received, except for compressed
+ * ones (RSV1 set), which the application validates once decompressed.
+ */
+int wslay_event_validate_utf8(const uint8_t *data, size_t len);
+
+/*
+ * Sets the sizes of the buffer that frames are read into, and of the
+ * buffer that wslay_event_fragmented_msg_callback fills. Both are
+ * 4096 bytes by default. The frame buffer must be at least 14 bytes,
+ * which is the longest frame header.
+ *
+ * This function must not be used after the first invocation of
+ * wslay_event_recv() or wslay_event_send() function.
+ *
+ * On success, returns 0. On error, returns one of following negative
+ * values:
+ *
+ * WSLAY_ERR_INVALID_ARGUMENT
+ *   The frame buffer is too small, or the fragment buffer is empty.
+ * WSLAY_ERR_NOMEM
+ *   Out of memory.
+ */
+int wslay_event_config_set_buffer_sizes(wslay_event_context_ptr ctx,
+                                        size_t recv_buffer_size,
+                                        size_t send_buffer_size);
+
 /*
  * Sets maximum length of a message that can be received. The length
  * of message is checked by wslay_event_recv() function. If the length
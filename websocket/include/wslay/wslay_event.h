@@ -66,6 +66,27 @@ struct wslay_event_omsg {
   wslay_event_fragmented_msg_callback read_callback;
 };
 
+/* Number of size classes in the per context allocator */
+#define WSLAY_EVENT_POOL_NUM_CLASSES 4
+
+/* Precedes every pooled allocation */
+union wslay_event_pool_header {
+  /* size class of the allocation, or WSLAY_EVENT_POOL_NUM_CLASSES if
+     it's too large to be recycled */
+  size_t size_class;
+  /* next free block, while on a free list */
+  union wslay_event_pool_header *next;
+  /* keep the allocation aligned */
+  uint64_t align;
+  double align_double;
+};
+
+/* Free lists recycling the message and chunk allocations */
+struct wslay_event_pool {
+  union wslay_event_pool_header *free_list[WSLAY_EVENT_POOL_NUM_CLASSES];
+  uint32_t free_count[WSLAY_EVENT_POOL_NUM_CLASSES];
+};
+
 struct wslay_event_frame_user_data {
   wslay_event_context_ptr ctx;
   void *user_data;
@@ -126,7 +147,8 @@ struct wslay_event_context {
   /* The sum of message length in send_queue */
   size_t queued_msg_length;
   /* Buffer used for fragmented messages */
-  uint8_t obuf[4096];
+  uint8_t *obuf;
+  size_t obuflen;
   uint8_t *obuflimit;
   uint8_t *obufmark;
   /* payload length of frame currently being sent. */
@@ -137,6 +159,8 @@ struct wslay_event_context {
   struct wslay_event_frame_user_data frame_user_data;
   void *user_data;
   uint8_t allowed_rsv_bits;
+  /* allocator for messages and chunks */
+  struct wslay_event_pool pool;
 };
 
 #endif /* WSLAY_EVENT_H */
@@ -48,10 +48,17 @@ struct wslay_frame_opcode_memo {
   uint8_t rsv;
 };
 
+#define WSLAY_DEFAULT_BUFLEN 4096
+
 struct wslay_frame_context {
-  uint8_t ibuf[4096];
+  uint8_t *ibuf;
+  size_t ibuflen;
   uint8_t *ibufmark;
   uint8_t *ibuflimit;
+  /* Buffer that the next payload is read into, instead of ibuf. Only
+     used by the next wslay_frame_recv() call. */
+  uint8_t *ipayloadbuf;
+  size_t ipayloadbuflen;
   struct wslay_frame_opcode_memo iom;
   uint64_t ipayloadlen;
   uint64_t ipayloadoff;
@@ -0,0 +1,93 @@
+// The browser WebSocket backend of the extension, used in HTML5 builds. See src/browser.cpp
+var LibraryWebsocket = {
+    $WebsocketJS: {
+        sockets: {},
+        nextId: 1,
+
+        // Matches BrowserEvent in browser.cpp
+        EVENT_OPEN: 0,
+        EVENT_CLOSE: 1,
+    },
+
+    WebsocketJS_Connect__deps: ["$WebsocketJS", "malloc", "free"],
+    WebsocketJS_Connect: function(url, protocols, conn, onEvent, onMessage) {
+        url = UTF8ToString(url);
+        // A page served over https can't open unencrypted sockets
+        if (window.location.protocol === "https:" && url.indexOf("ws://") === 0)
+            url = "wss://" + url.substring(5);
+
+        var list = [];
+        if (protocols)
+            list = UTF8ToString(protocols).split(",").map(function(p) { return p.trim(); });
+
+        var ws;
+        try {
+            ws = new WebSocket(url, list);
+        } catch (e) {
+            console.error("websocket: " + e);
+            return 0;
+        }
+        ws.binaryType = "arraybuffer";
+
+        var id = WebsocketJS.nextId++;
+        WebsocketJS.sockets[id] = ws;
+
+        ws.onopen = function() {
+            {{{ makeDynCall("viiii", "onEvent") }}}(conn, WebsocketJS.EVENT_OPEN, 0, 0);
+        };
+        // An error is always followed by a close, which reports it
+        ws.onclose = function(e) {
+            var size = lengthBytesUTF8(e.reason) + 1;
+            var reason = _malloc(size);
+            stringToUTF8(e.reason, reason, size);
+            {{{ makeDynCall("viiii", "onEvent") }}}(conn, WebsocketJS.EVENT_CLOSE, e.code, reason);
+            _free(reason);
+        };
+        // The message is written straight into the one queued for the script side
+        ws.onmessage = function(e) {
+            var ptr;
+            if (typeof e.data === "string") {
+                var length = lengthBytesUTF8(e.data);
+                ptr = {{{ makeDynCall("iii", "onMessage") }}}(conn, length);
+                if (ptr)
+                    stringToUTF8(e.data, ptr, length + 1);
+            } else {
+                var data = new Uint8Array(e.data);
+                ptr = {{{ makeDynCall("iii", "onMessage") }}}(conn, data.length);
+                // The heap may have grown in the call, so HEAPU8 is read after it
+                if (ptr)
+                    HEAPU8.set(data, ptr);
+            }
+        };
+        return id;
+    },
+
+    WebsocketJS_Send__deps: ["$WebsocketJS"],
+    WebsocketJS_Send: function(id, data, length, text) {
+        var ws = WebsocketJS.sockets[id];
+        if (!ws || ws.readyState !== WebSocket.OPEN)
+            return 0;
+        // The data is copied, since the heap may change before the browser sends it
+        ws.send(text ? UTF8ToString(data, length) : HEAPU8.slice(data, data + length));
+        return 1;
+    },
+
+    WebsocketJS_GetBufferedAmount__deps: ["$WebsocketJS"],
+    WebsocketJS_GetBufferedAmount: function(id) {
+        var ws = WebsocketJS.sockets[id];
+        return ws ? ws.bufferedAmount : 0;
+    },
+
+    WebsocketJS_Close__deps: ["$WebsocketJS"],
+    WebsocketJS_Close: function(id) {
+        var ws = WebsocketJS.sockets[id];
+        if (!ws)
+            return;
+        delete WebsocketJS.sockets[id];
+        ws.onopen = ws.onclose = ws.onmessage = null;
+        if (ws.readyState === WebSocket.CONNECTING || ws.readyState === WebSocket.OPEN)
+            ws.close(1000);
+    },
+};
+
+mergeInto(LibraryManager.library, LibraryWebsocket);
@@ -0,0 +1,120 @@
+#include "websocket.h"
+
+// In emscripten, the connections are browser WebSockets, see lib/web/library_websocket.js.
+// The browser does the framing, so each message arrives whole, and is copied once from js,
+// straight into the message that's queued for the script side
+#if defined(__EMSCRIPTEN__)
+
+namespace dmWebsocket
+{
+    // Matches library_websocket.js
+    enum BrowserEvent
+    {
+        BROWSER_EVENT_OPEN  = 0,
+        BROWSER_EVENT_CLOSE = 1,
+    };
+
+    typedef void (*BrowserEventCallback)(WebsocketConnection* conn, int event, int code, const char* reason);
+    typedef char* (*BrowserMessageCallback)(WebsocketConnection* conn, uint32_t length);
+}
+
+extern "C"
+{
+    int      WebsocketJS_Connect(const char* url, const char* protocols, dmWebsocket::WebsocketConnection* conn,
+                                 dmWebsocket::BrowserEventCallback on_event, dmWebsocket::BrowserMessageCallback on_message);
+    int      WebsocketJS_Send(int socket, const char* data, uint32_t length, int text);
+    uint32_t WebsocketJS_GetBufferedAmount(int socket);
+    void     WebsocketJS_Close(int socket);
+}
+
+namespace dmWebsocket
+{
+
+static void OnBrowserEvent(WebsocketConnection* conn, int event, int code, const char* reason)
+{
+    if (BROWSER_EVENT_OPEN == event)
+    {
+        SetState(conn, STATE_CONNECTED);
+        PushEvent(conn, EVENT_CONNECTED, 0, 0);
+        return;
+    }
+
+    // 1000 is a normal close. The browser doesn't tell why a connection failed, which shows up as 1006
+    if (STATE_DISCONNECTED == conn->m_State)
+        return;
+    if (code != 1000)
+        SetStatus(conn, RESULT_ERROR, "Websocket closed for %s (%d%s%s)", conn->m_Url.m_Hostname, code, reason[0] ? ": " : "", reason);
+    SetState(conn, STATE_DISCONNECTED);
+}
+
+// Returns where js should write the message, or 0 to drop it. Text messages are written as utf-8
+static char* OnBrowserMessage(WebsocketConnection* conn, uint32_t length)
+{
+    if (STATE_CONNECTED != conn->m_State)
+        return 0;
+
+    if (length > conn->m_MaxMessageSize)
+    {
+        SetStatus(conn, RESULT_ERROR, "Received message is too big: %u bytes (max %u)", length, conn->m_MaxMessageSize);
+        SetState(conn, STATE_DISCONNECTED);
+        return 0;
+    }
+
+    conn->m_Stats.m_BytesReceived += length;
+    ++conn->m_Stats.m_FramesReceived;
+    ++conn->m_Stats.m_MessagesReceived;
+
+    // The message is only dispatched in the next update, after js has filled it in
+    Message* msg = NewMessage(EVENT_MESSAGE, 0, length);
+    if (!msg)
+    {
+        SetStatus(conn, RESULT_ERROR, "Out of memory receiving a message of %u bytes", length);
+        SetState(conn, STATE_DISCONNECTED);
+        return 0;
+    }
+    PushMessage(conn, msg);
+    return (char*)GetMessageData(msg);
+}
+
+Result BrowserConnect(WebsocketConnection* conn)
+{
+    char port[8] = "";
+    if (!(conn->m_Url.m_Port == 80 || conn->m_Url.m_Port == 443))
+        dmSnPrintf(port, sizeof(port), ":%d", conn->m_Url.m_Port);
+
+    const char* path_prefix = conn->m_Url.m_Path[0] == '/' ? "" : "/";
+
+    char url[dmURI::MAX_URI_LEN];
+    dmSnPrintf(url, sizeof(url), "%s://%s%s%s%s", conn->m_SSL ? "wss" : "ws", conn->m_Url.m_Hostname, port, path_prefix, conn->m_Url.m_Path);
+
+    conn->m_BrowserSocket = WebsocketJS_Connect(url, conn->m_Protocol, conn, OnBrowserEvent, OnBrowserMessage);
+    if (!conn->m_BrowserSocket)
+        return SetStatus(conn, RESULT_ERROR, "Failed to create a websocket for '%s'", url);
+    return RESULT_OK;
+}
+
+bool BrowserSend(WebsocketConnection* conn, const char* data, uint32_t length, DataType type)
+{
+    if (!WebsocketJS_Send(conn->m_BrowserSocket, data, length, DATA_TYPE_TEXT == type ? 1 : 0))
+        return false;
+    conn->m_Stats.m_BytesSent += length;
+    return true;
+}
+
+uint32_t BrowserGetBufferedAmount(WebsocketConnection* conn)
+{
+    return conn->m_BrowserSocket ? WebsocketJS_GetBufferedAmount(conn->m_BrowserSocket) : 0;
+}
+
+// The socket doesn't call back after this, so the connection can be destroyed
+void BrowserClose(WebsocketConnection* conn)
+{
+    if (!conn->m_BrowserSocket)
+        return;
+    WebsocketJS_Close(conn->m_BrowserSocket);
+    conn->m_BrowserSocket = 0;
+}
+
+} // namespace
+
+#endif // __EMSCRIPTEN__
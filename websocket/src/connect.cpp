@@ -0,0 +1,267 @@
+#include "websocket.h"
+#include <dmsdk/dlib/socket.h>
+#include <dmsdk/dlib/sslsocket.h>
+#include <dmsdk/dlib/condition_variable.h>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#endif
+
+// In emscripten, the browser does the resolving, connecting and encryption for us
+#if !defined(__EMSCRIPTEN__)
+
+namespace dmWebsocket
+{
+
+// The host name lookup and the tls handshake only have blocking implementations, so they run as jobs on one
+// worker thread, in the order they were started, while the connections poll for the results. The thread is
+// started with the first job, and lives until the extension is finalized
+
+struct ConnectWorker
+{
+    dmThread::Thread                        m_Thread;
+    dmMutex::HMutex                         m_Mutex;
+    dmConditionVariable::HConditionVariable m_Cond;
+    dmArray<WebsocketConnection*>           m_Jobs;     // Not yet started, protected by m_Mutex
+    bool                                    m_Running;  // Protected by m_Mutex
+    bool                                    m_Started;
+} g_ConnectWorker;
+
+// Keeps the order of the jobs behind it
+static void RemoveJob(uint32_t index)
+{
+    dmArray<WebsocketConnection*>& jobs = g_ConnectWorker.m_Jobs;
+    for (uint32_t i = index + 1; i < jobs.Size(); ++i)
+        jobs[i - 1] = jobs[i];
+    jobs.Pop();
+}
+
+static void ConnectWorkerThread(void*)
+{
+    while (true)
+    {
+        WebsocketConnection* conn = 0;
+        {
+            DM_MUTEX_SCOPED_LOCK(g_ConnectWorker.m_Mutex);
+            while (g_ConnectWorker.m_Running && g_ConnectWorker.m_Jobs.Empty())
+                dmConditionVariable::Wait(g_ConnectWorker.m_Cond, g_ConnectWorker.m_Mutex);
+            if (!g_ConnectWorker.m_Running)
+                return;
+            conn = g_ConnectWorker.m_Jobs[0];
+            RemoveJob(0);
+        }
+        conn->m_Job(conn);
+        dmAtomicStore32(&conn->m_JobDone, 1);
+    }
+}
+
+static void StartJob(WebsocketConnection* conn, dmThread::ThreadStart job)
+{
+    assert(!conn->m_JobRunning);
+    dmAtomicStore32(&conn->m_JobDone, 0);
+    conn->m_JobRunning = 1;
+    conn->m_Job = job;
+
+    if (!g_ConnectWorker.m_Mutex)
+    {
+        g_ConnectWorker.m_Mutex = dmMutex::New();
+        g_ConnectWorker.m_Cond = dmConditionVariable::New();
+    }
+    DM_MUTEX_SCOPED_LOCK(g_ConnectWorker.m_Mutex);
+    if (!g_ConnectWorker.m_Started)
+    {
+        g_ConnectWorker.m_Running = true;
+        g_ConnectWorker.m_Started = true;
+        g_ConnectWorker.m_Thread = dmThread::New(ConnectWorkerThread, 0x40000, 0, "websocket_connect");
+    }
+    if (g_ConnectWorker.m_Jobs.Full())
+        g_ConnectWorker.m_Jobs.OffsetCapacity(8);
+    g_ConnectWorker.m_Jobs.Push(conn);
+    dmConditionVariable::Signal(g_ConnectWorker.m_Cond);
+}
+
+void StopConnectWorker()
+{
+    if (!g_ConnectWorker.m_Mutex)
+        return;
+    {
+        DM_MUTEX_SCOPED_LOCK(g_ConnectWorker.m_Mutex);
+        g_ConnectWorker.m_Running = false;
+        dmConditionVariable::Signal(g_ConnectWorker.m_Cond);
+    }
+    // The job in progress is finished first
+    if (g_ConnectWorker.m_Started)
+        dmThread::Join(g_ConnectWorker.m_Thread);
+    g_ConnectWorker.m_Jobs.SetCapacity(0);
+    dmConditionVariable::Delete(g_ConnectWorker.m_Cond);
+    dmMutex::Delete(g_ConnectWorker.m_Mutex);
+    g_ConnectWorker.m_Mutex = 0;
+    g_ConnectWorker.m_Started = false;
+}
+
+static bool IsJobDone(WebsocketConnection* conn)
+{
+    return dmAtomicGet32(&conn->m_JobDone) != 0;
+}
+
+bool FinishConnectJob(WebsocketConnection* conn)
+{
+    if (!conn->m_JobRunning)
+        return true;
+    if (!IsJobDone(conn))
+    {
+        // A job that hasn't started is dropped, so a closed connection doesn't wait for the ones ahead of it
+        DM_MUTEX_SCOPED_LOCK(g_ConnectWorker.m_Mutex);
+        for (uint32_t i = 0; i < g_ConnectWorker.m_Jobs.Size(); ++i)
+        {
+            if (g_ConnectWorker.m_Jobs[i] == conn)
+            {
+                RemoveJob(i);
+                conn->m_JobRunning = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+    conn->m_JobRunning = 0;
+    return true;
+}
+
+static void ResolveJob(void* _conn)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)_conn;
+    conn->m_JobResult = dmSocket::GetHostByName(conn->m_Url.m_Hostname, &conn->m_Address, true, true);
+}
+
+static void TlsHandshakeJob(void* _conn)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)_conn;
+    conn->m_JobResult = dmSSLSocket::New(conn->m_Socket, conn->m_Url.m_Hostname, conn->m_JobTimeout, &conn->m_SSLSocket);
+}
+
+void StartResolve(WebsocketConnection* conn)
+{
+    StartJob(conn, ResolveJob);
+}
+
+Result PollResolve(WebsocketConnection* conn)
+{
+    if (!IsJobDone(conn))
+        return RESULT_WOULDBLOCK;
+    FinishConnectJob(conn);
+
+    dmSocket::Result sr = (dmSocket::Result)conn->m_JobResult;
+    if (dmSocket::RESULT_OK != sr)
+    {
+        return SetStatus(conn, RESULT_ERROR, "Failed to get address from host name '%s': %s", conn->m_Url.m_Hostname, dmSocket::ResultToString(sr));
+    }
+    conn->m_AddressResolved = 1;
+    return RESULT_OK;
+}
+
+Result StartConnect(WebsocketConnection* conn)
+{
+    dmSocket::Result sr = dmSocket::New(conn->m_Address.m_family, dmSocket::TYPE_STREAM, dmSocket::PROTOCOL_TCP, &conn->m_Socket);
+    if (dmSocket::RESULT_OK != sr)
+    {
+        return SetStatus(conn, RESULT_ERROR, "Failed to create socket for '%s': %s", conn->m_Url.m_Hostname, dmSocket::ResultToString(sr));
+    }
+
+    dmSocket::SetBlocking(conn->m_Socket, false);
+
+    sr = dmSocket::Connect(conn->m_Socket, conn->m_Address, conn->m_Url.m_Port);
+    if (dmSocket::RESULT_OK != sr && dmSocket::RESULT_INPROGRESS != sr && dmSocket::RESULT_WOULDBLOCK != sr)
+    {
+        return SetStatus(conn, RESULT_ERROR, "Failed to connect to '%s:%d': %s", conn->m_Url.m_Hostname, (int)conn->m_Url.m_Port, dmSocket::ResultToString(sr));
+    }
+
+    conn->m_ConnectStart = dmTime::GetTime();
+    return RESULT_OK;
+}
+
+// The error of a finished connect, 0 if it succeeded
+static int GetConnectError(dmSocket::Socket socket)
+{
+    int error = 0;
+#if defined(_WIN32)
+    int size = sizeof(error);
+    if (0 != getsockopt(dmSocket::GetFD(socket), SOL_SOCKET, SO_ERROR, (char*)&error, &size))
+        return -1;
+#else
+    socklen_t size = sizeof(error);
+    if (0 != getsockopt(dmSocket::GetFD(socket), SOL_SOCKET, SO_ERROR, &error, &size))
+        return -1;
+#endif
+    return error;
+}
+
+Result PollConnect(WebsocketConnection* conn, uint64_t timeout)
+{
+    // The socket becomes writable once the connect is done, whether it succeeded or not
+    dmSocket::Selector selector;
+    dmSocket::SelectorZero(&selector);
+    dmSocket::SelectorSet(&selector, dmSocket::SELECTOR_KIND_WRITE, conn->m_Socket);
+    dmSocket::SelectorSet(&selector, dmSocket::SELECTOR_KIND_EXCEPT, conn->m_Socket);
+
+    dmSocket::Result sr = dmSocket::Select(&selector, 0);
+    if (dmSocket::RESULT_OK == sr && dmSocket::SelectorIsSet(&selector, dmSocket::SELECTOR_KIND_EXCEPT, conn->m_Socket))
+    {
+        return SetStatus(conn, RESULT_ERROR, "Failed to connect to '%s:%d'", conn->m_Url.m_Hostname, (int)conn->m_Url.m_Port);
+    }
+
+    if (dmSocket::RESULT_OK == sr && dmSocket::SelectorIsSet(&selector, dmSocket::SELECTOR_KIND_WRITE, conn->m_Socket))
+    {
+        int error = GetConnectError(conn->m_Socket);
+        if (0 != error)
+        {
+#if defined(_WIN32)
+            return SetStatus(conn, RESULT_ERROR, "Failed to connect to '%s:%d': error %d", conn->m_Url.m_Hostname, (int)conn->m_Url.m_Port, error);
+#else
+            return SetStatus(conn, RESULT_ERROR, "Failed to connect to '%s:%d': %s", conn->m_Url.m_Hostname, (int)conn->m_Url.m_Port, error > 0 ? strerror(error) : "unknown error");
+#endif
+        }
+
+        // The handshakes expect a blocking socket, and the socket is made non blocking again once connected
+        dmSocket::SetBlocking(conn->m_Socket, true);
+        // Bounds each blocking write of the handshake, see SendAll()
+        dmSocket::SetSendTimeout(conn->m_Socket, timeout);
+        return RESULT_OK;
+    }
+
+    if (dmSocket::RESULT_OK != sr && dmSocket::RESULT_WOULDBLOCK != sr)
+    {
+        return SetStatus(conn, RESULT_ERROR, "Failed waiting for connection to '%s:%d': %s", conn->m_Url.m_Hostname, (int)conn->m_Url.m_Port, dmSocket::ResultToString(sr));
+    }
+
+    if (dmTime::GetTime() - conn->m_ConnectStart > timeout)
+    {
+        return SetStatus(conn, RESULT_ERROR, "Timed out connecting to '%s:%d'", conn->m_Url.m_Hostname, (int)conn->m_Url.m_Port);
+    }
+
+    return RESULT_WOULDBLOCK;
+}
+
+void StartTlsHandshake(WebsocketConnection* conn, uint64_t timeout)
+{
+    conn->m_JobTimeout = timeout;
+    StartJob(conn, TlsHandshakeJob);
+}
+
+Result PollTlsHandshake(WebsocketConnection* conn)
+{
+    if (!IsJobDone(conn))
+        return RESULT_WOULDBLOCK;
+    FinishConnectJob(conn);
+
+    dmSSLSocket::Result r = (dmSSLSocket::Result)conn->m_JobResult;
+    if (dmSSLSocket::RESULT_OK != r)
+    {
+        conn->m_SSLSocket = dmSSLSocket::INVALID_SOCKET_HANDLE;
+        return SetStatus(conn, RESULT_ERROR, "Failed tls handshake with '%s': %d", conn->m_Url.m_Hostname, r);
+    }
+    return RESULT_OK;
+}
+
+} // namespace
+
+#endif // !__EMSCRIPTEN__
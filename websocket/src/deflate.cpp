@@ -0,0 +1,173 @@
+#include "websocket.h"
+
+#if defined(HAVE_ZLIB)
+
+#include <zlib.h>
+
+namespace dmWebsocket
+{
+
+// The streams live as long as the connection, so that the context can be kept between messages
+struct DeflateState
+{
+    z_stream            m_Deflate;
+    z_stream            m_Inflate;
+    dmArray<uint8_t>    m_Output;   // Result of the last compress or decompress
+    uint32_t            m_MaxInflatedSize;
+};
+
+// Each message ends with an empty stored block, which is left out on the wire
+static const uint8_t DEFLATE_TAIL[4] = {0x00, 0x00, 0xff, 0xff};
+
+static const uint32_t DEFLATE_MIN_OUTPUT_CHUNK = 1024;
+
+Result DeflateInit(WebsocketConnection* conn)
+{
+    DeflateState* state = new DeflateState;
+    memset(&state->m_Deflate, 0, sizeof(state->m_Deflate));
+    memset(&state->m_Inflate, 0, sizeof(state->m_Inflate));
+    state->m_MaxInflatedSize = conn->m_MaxMessageSize;
+
+    if (Z_OK != deflateInit2(&state->m_Deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -(int)conn->m_DeflateWindowBits, 8, Z_DEFAULT_STRATEGY))
+    {
+        delete state;
+        return SetStatus(conn, RESULT_ERROR, "Failed to create deflate stream");
+    }
+
+    // The server may use any window size, up to the maximum
+    if (Z_OK != inflateInit2(&state->m_Inflate, -MAX_WBITS))
+    {
+        deflateEnd(&state->m_Deflate);
+        delete state;
+        return SetStatus(conn, RESULT_ERROR, "Failed to create inflate stream");
+    }
+
+    conn->m_Deflate = state;
+    return RESULT_OK;
+}
+
+void DeflateExit(WebsocketConnection* conn)
+{
+    DeflateState* state = conn->m_Deflate;
+    if (!state)
+        return;
+    deflateEnd(&state->m_Deflate);
+    inflateEnd(&state->m_Inflate);
+    delete state;
+    conn->m_Deflate = 0;
+}
+
+static void ReserveOutput(dmArray<uint8_t>& output, uint32_t size)
+{
+    if (output.Remaining() < size)
+        output.OffsetCapacity(size - output.Remaining());
+}
+
+bool DeflateCompress(WebsocketConnection* conn, const void* data, uint32_t length, const uint8_t** out, uint32_t* out_length)
+{
+    DeflateState* state = conn->m_Deflate;
+    if (!state || length < conn->m_DeflateMinSize)
+        return false;
+
+    z_stream& strm = state->m_Deflate;
+    dmArray<uint8_t>& output = state->m_Output;
+    output.SetSize(0);
+    ReserveOutput(output, (uint32_t)deflateBound(&strm, length) + 16);
+
+    strm.next_in = (Bytef*)data;
+    strm.avail_in = length;
+    do
+    {
+        if (output.Remaining() < DEFLATE_MIN_OUTPUT_CHUNK)
+            ReserveOutput(output, output.Capacity());
+        strm.next_out = output.End();
+        strm.avail_out = output.Remaining();
+        int r = deflate(&strm, Z_SYNC_FLUSH);
+        output.SetSize(output.Capacity() - strm.avail_out);
+        if (Z_OK != r && Z_BUF_ERROR != r)
+        {
+            // Start over with an empty context, and send this message as is
+            deflateReset(&strm);
+            return false;
+        }
+    } while (strm.avail_out == 0);
+
+    uint32_t size = output.Size();
+    if (size >= sizeof(DEFLATE_TAIL) && memcmp(output.End() - sizeof(DEFLATE_TAIL), DEFLATE_TAIL, sizeof(DEFLATE_TAIL)) == 0)
+        size -= sizeof(DEFLATE_TAIL);
+
+    if (conn->m_DeflateNoContextTakeover)
+        deflateReset(&strm);
+
+    // With the context kept, the message has to be sent compressed, since the server now has it in its window
+    if (size >= length && conn->m_DeflateNoContextTakeover)
+        return false;
+
+    *out = output.Begin();
+    *out_length = size;
+    return true;
+}
+
+int DeflateDecompress(WebsocketConnection* conn, const void* data, uint32_t length, const uint8_t** out, uint32_t* out_length)
+{
+    DeflateState* state = conn->m_Deflate;
+    if (!state)
+        return WSLAY_CODE_PROTOCOL_ERROR;
+
+    z_stream& strm = state->m_Inflate;
+    dmArray<uint8_t>& output = state->m_Output;
+    output.SetSize(0);
+    ReserveOutput(output, length * 4 + DEFLATE_MIN_OUTPUT_CHUNK);
+
+    // Inflate the message, and then the tail that was stripped by the sender
+    const uint8_t* inputs[2] = { (const uint8_t*)data, DEFLATE_TAIL };
+    uint32_t input_lengths[2] = { length, sizeof(DEFLATE_TAIL) };
+    bool done = false;
+    for (int i = 0; i < 2 && !done; ++i)
+    {
+        strm.next_in = (Bytef*)inputs[i];
+        strm.avail_in = input_lengths[i];
+        while (strm.avail_in > 0)
+        {
+            if (output.Remaining() < DEFLATE_MIN_OUTPUT_CHUNK)
+            {
+                if (output.Capacity() >= state->m_MaxInflatedSize)
+                    return WSLAY_CODE_MESSAGE_TOO_BIG;
+                ReserveOutput(output, output.Capacity());
+            }
+            strm.next_out = output.End();
+            strm.avail_out = output.Remaining();
+            int r = inflate(&strm, Z_SYNC_FLUSH);
+            output.SetSize(output.Capacity() - strm.avail_out);
+
+            // The sender may end the message with a final block, which also ends the context
+            if (Z_STREAM_END == r)
+            {
+                inflateReset(&strm);
+                done = true;
+                break;
+            }
+            if (Z_OK != r && !(Z_BUF_ERROR == r && strm.avail_out == 0))
+                return WSLAY_CODE_INVALID_FRAME_PAYLOAD_DATA;
+        }
+    }
+
+    if (output.Size() > state->m_MaxInflatedSize)
+        return WSLAY_CODE_MESSAGE_TOO_BIG;
+
+    *out = output.Begin();
+    *out_length = output.Size();
+    return 0;
+}
+
+void DeflateTrim(WebsocketConnection* conn)
+{
+    if (!conn->m_Deflate)
+        return;
+    conn->m_Deflate->m_Output.SetSize(0);
+    conn->m_Deflate->m_Output.SetCapacity(0);
+}
+
+} // namespace
+
+#endif // HAVE_ZLIB
@@ -1,30 +1,18 @@
 #include "websocket.h"
 #include <dmsdk/dlib/socket.h>
+#include <ctype.h>
+
+// In emscripten, the browser WebSocket does the handshake, see browser.cpp
+#if !defined(__EMSCRIPTEN__)
 
 namespace dmWebsocket
 {
 
 const char* RFC_MAGIC = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"; // as per the rfc document on page 7 (https://tools.ietf.org/html/rfc6455)
 
-static void CreateKey(uint8_t* key, size_t len)
-{
-    pcg32_random_t rnd;
-    pcg32_srandom_r(&rnd, dmTime::GetTime(), 31452);
-    for (unsigned int i = 0; i < len; i++) {
-        key[i] = (char)(uint8_t)(pcg32_random_r(&rnd) & 0xFF);
-    }
-}
-
-#define WS_SENDALL(s) \
-    sr = Send(conn, s, strlen(s), 0);\
-    if (sr != dmSocket::RESULT_OK)\
-    {\
-        goto bail;\
-    }\
-
-static Result SendClientHandshakeHeaders(WebsocketConnection* conn)
+static Result SendClientHandshakeHeaders(WebsocketConnection* conn, uint64_t timeout)
 {
-    CreateKey(conn->m_Key, sizeof(conn->m_Key));
+    pcg32_random_bytes_r(&conn->m_Rnd, conn->m_Key, sizeof(conn->m_Key));
 
     char encoded_key[64] = {0};
     uint32_t encoded_key_len = sizeof(encoded_key);
@@ -38,39 +26,70 @@ static Result SendClientHandshakeHeaders(WebsocketConnection* conn)
     if (!(conn->m_Url.m_Port == 80 || conn->m_Url.m_Port == 443))
         dmSnPrintf(port, sizeof(port), ":%d", conn->m_Url.m_Port);
 
-    dmSocket::Result sr;
-    WS_SENDALL("GET /");
-    WS_SENDALL(conn->m_Url.m_Path);
-    WS_SENDALL(" HTTP/1.1\r\n");
-    WS_SENDALL("Host: ");
-    WS_SENDALL(conn->m_Url.m_Hostname);
-    WS_SENDALL(port);
-    WS_SENDALL("\r\n");
-    WS_SENDALL("Upgrade: websocket\r\n");
-    WS_SENDALL("Connection: Upgrade\r\n");
-    WS_SENDALL("Sec-WebSocket-Key: ");
-    WS_SENDALL(encoded_key);
-    WS_SENDALL("\r\n");
-    WS_SENDALL("Sec-WebSocket-Version: 13\r\n");
+    const char* path_prefix = conn->m_Url.m_Path[0] == '/' ? "" : "/";
+
+    const char* protocol = conn->m_Protocol ? conn->m_Protocol : "";
+    const char* protocol_header = conn->m_Protocol ? "Sec-WebSocket-Protocol: " : "";
+    const char* protocol_end = conn->m_Protocol ? "\r\n" : "";
+
+    const char* custom_headers = conn->m_CustomHeaders ? conn->m_CustomHeaders : "";
+    size_t custom_headers_len = strlen(custom_headers);
+    const char* custom_headers_end = (custom_headers_len >= 2 && strcmp(custom_headers + custom_headers_len - 2, "\r\n") == 0) || custom_headers_len == 0 ? "" : "\r\n";
 
-    // Add custom protocols
+    char extensions[128] = "";
+#if defined(HAVE_ZLIB)
+    if (conn->m_DeflateRequested)
+        dmSnPrintf(extensions, sizeof(extensions), "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits=%d%s\r\n",
+                    conn->m_DeflateWindowBits, conn->m_DeflateNoContextTakeover ? "; client_no_context_takeover" : "");
+#endif
+
+    // The whole request goes out in a single write, which with tls also means a single record.
+    // The buffer grows until the request fits
+    GrowBuffer(conn, BUFFER_INITIAL_SIZE);
+    int length;
+    while (true)
+    {
+        length = dmSnPrintf(conn->m_Buffer, conn->m_BufferCapacity,
+                            "GET %s%s HTTP/1.1\r\n"
+                            "Host: %s%s\r\n"
+                            "Upgrade: websocket\r\n"
+                            "Connection: Upgrade\r\n"
+                            "Sec-WebSocket-Key: %s\r\n"
+                            "Sec-WebSocket-Version: 13\r\n"
+                            "%s"
+                            "%s%s%s"
+                            "%s%s"
+                            "\r\n",
+                            path_prefix, conn->m_Url.m_Path,
+                            conn->m_Url.m_Hostname, port,
+                            encoded_key,
+                            extensions,
+                            protocol_header, protocol, protocol_end,
+                            custom_headers, custom_headers_end);
+
+        if (length >= 0 && (uint32_t)length < conn->m_BufferCapacity)
+            break;
+
+        if (!GrowBuffer(conn, conn->m_BufferCapacity + 1))
+        {
+            return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Handshake request doesn't fit in the buffer: %u bytes", conn->m_BufferCapacity);
+        }
+    }
 
-    // Add custom headers
+    dmSocket::Result sr = SendAll(conn, conn->m_Buffer, length, timeout);
 
-    WS_SENDALL("\r\n");
+    // The buffer is reused for the response
+    conn->m_BufferSize = 0;
 
-bail:
     if (sr != dmSocket::RESULT_OK)
     {
-        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "SendClientHandshake failed: %s", dmSocket::ResultToString(sr));
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "SendClientHandshake failed: %s", dmSocket::RESULT_WOULDBLOCK == sr ? "timed out" : dmSocket::ResultToString(sr));
     }
 
     return RESULT_OK;
 }
 
-#undef WS_SENDALL
-
-Result SendClientHandshake(WebsocketConnection* conn)
+Result SendClientHandshake(WebsocketConnection* conn, uint64_t timeout)
 {
     dmSocket::Result sr = WaitForSocket(conn, dmSocket::SELECTOR_KIND_WRITE, SOCKET_WAIT_TIMEOUT);
     if (dmSocket::RESULT_WOULDBLOCK == sr)
@@ -82,42 +101,51 @@ Result SendClientHandshake(WebsocketConnection* conn)
         return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Connection not ready for sending data: %s", dmSocket::ResultToString(sr));
     }
 
-// In emscripten, the sockets are actually already websockets, so no handshake necessary
-#if defined(__EMSCRIPTEN__)
-    return RESULT_OK;
-#else
-    return SendClientHandshakeHeaders(conn);
-#endif
+    return SendClientHandshakeHeaders(conn, timeout);
 }
 
-
-#if defined(__EMSCRIPTEN__)
-Result ReceiveHeaders(WebsocketConnection* conn)
+// Searches the bytes received since the last call for the empty line that ends the response headers
+static bool FindHeaderEnd(WebsocketConnection* conn)
 {
-    return RESULT_OK;
+    const char* buffer = conn->m_Buffer;
+    uint32_t size = (uint32_t)conn->m_BufferSize;
+
+    // Back up a little, in case the "\r\n\r\n" was split between two reads
+    uint32_t i = conn->m_HeaderScanned > 3 ? conn->m_HeaderScanned - 3 : 0;
+    for (; i + 4 <= size; ++i)
+    {
+        if (buffer[i] == '\r' && buffer[i+1] == '\n' && buffer[i+2] == '\r' && buffer[i+3] == '\n')
+        {
+            conn->m_HeaderLength = i + 4;
+            return true;
+        }
+    }
+    conn->m_HeaderScanned = size;
+    return false;
 }
 
-#else
 Result ReceiveHeaders(WebsocketConnection* conn)
 {
     dmSocket::Selector selector;
     dmSocket::SelectorZero(&selector);
     dmSocket::SelectorSet(&selector, dmSocket::SELECTOR_KIND_READ, conn->m_Socket);
 
-    dmSocket::Result sr = dmSocket::Select(&selector, 200*1000);
+    // Only poll the socket, the update loop will call us again
+    dmSocket::Result sr = dmSocket::Select(&selector, 0);
 
     if (dmSocket::RESULT_OK != sr)
     {
-        if (dmSocket::RESULT_WOULDBLOCK)
+        if (dmSocket::RESULT_WOULDBLOCK == sr)
         {
-            dmLogWarning("Waiting for socket to be available for reading");
             return RESULT_WOULDBLOCK;
         }
 
         return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Failed waiting for more handshake headers: %s", dmSocket::ResultToString(sr));
     }
 
-    int max_to_recv = (int)(conn->m_BufferCapacity - 1) - conn->m_BufferSize; // allow for a terminating null character
+    // Room for at least one more byte, and a terminating null character
+    GrowBuffer(conn, (uint32_t)conn->m_BufferSize + 2);
+    int max_to_recv = (int)conn->m_BufferCapacity - 1 - conn->m_BufferSize;
 
     if (max_to_recv <= 0)
     {
@@ -145,82 +173,238 @@ Result ReceiveHeaders(WebsocketConnection* conn)
     // NOTE: We have an extra byte for null-termination so no buffer overrun here.
     conn->m_Buffer[conn->m_BufferSize] = '\0';
 
-    // Check if the end of the response has arrived
-    if (conn->m_BufferSize >= 4 && strcmp(conn->m_Buffer + conn->m_BufferSize - 4, "\r\n\r\n") == 0)
+    // The first websocket frames may arrive in the same read as the end of the response
+    if (FindHeaderEnd(conn))
     {
         return RESULT_OK;
     }
 
     return RESULT_WOULDBLOCK;
 }
-#endif
 
-#if defined(__EMSCRIPTEN__)
-Result VerifyHeaders(WebsocketConnection* conn)
+// Case insensitive compare of a header token with a null terminated string
+static bool TokenEquals(const char* token, uint32_t token_len, const char* expected)
 {
-    return RESULT_OK;
+    for (uint32_t i = 0; i < token_len; ++i, ++expected)
+    {
+        if (*expected == 0 || tolower((unsigned char)token[i]) != tolower((unsigned char)*expected))
+            return false;
+    }
+    return *expected == 0;
 }
-#else
-Result VerifyHeaders(WebsocketConnection* conn)
+
+// Whether a comma separated header value, such as "keep-alive, Upgrade", holds the token
+static bool HasToken(const char* value, uint32_t value_len, const char* expected)
 {
-    char* r = conn->m_Buffer;
+    const char* end = value + value_len;
+    while (value < end)
+    {
+        const char* token_end = (const char*)memchr(value, ',', end - value);
+        if (!token_end)
+            token_end = end;
+        const char* token = value;
+        const char* trimmed_end = token_end;
+        while (token < trimmed_end && (*token == ' ' || *token == '\t'))
+            ++token;
+        while (trimmed_end > token && (trimmed_end[-1] == ' ' || trimmed_end[-1] == '\t'))
+            --trimmed_end;
+        if (TokenEquals(token, (uint32_t)(trimmed_end - token), expected))
+            return true;
+        value = token_end + 1;
+    }
+    return false;
+}
 
-    // According to protocol, the response should start with "HTTP/1.1 <statuscode> <message>"
-    const char* http_version_and_status_protocol = "HTTP/1.1 101";
-    if (strstr(r, http_version_and_status_protocol) != r) {
-        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Missing: '%s' in header", http_version_and_status_protocol);
+struct HeaderLine
+{
+    const char* m_Key;      // 0 if the line has no colon
+    const char* m_Value;
+    uint32_t    m_KeyLength;
+    uint32_t    m_ValueLength;
+};
+
+// Splits the "Key: Value\r\n" line at r, and trims the spaces around the key and the value.
+// Returns the start of the next line, or 0 if there are no more lines before end
+static const char* NextHeaderLine(const char* r, const char* end, HeaderLine* header)
+{
+    const char* line_end = (const char*)memchr(r, '\n', end - r);
+    if (!line_end)
+        return 0;
+    const char* next = line_end + 1;
+    if (line_end > r && line_end[-1] == '\r')
+        --line_end;
+
+    header->m_Key = 0;
+    const char* colon = (const char*)memchr(r, ':', line_end - r);
+    if (colon)
+    {
+        const char* key_end = colon;
+        while (key_end > r && (key_end[-1] == ' ' || key_end[-1] == '\t'))
+            --key_end;
+
+        const char* value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t'))
+            ++value;
+        const char* value_end = line_end;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            --value_end;
+
+        header->m_Key = r;
+        header->m_KeyLength = (uint32_t)(key_end - r);
+        header->m_Value = value;
+        header->m_ValueLength = (uint32_t)(value_end - value);
     }
+    return next;
+}
 
-    r = strstr(r, "\r\n") + 2;
+// The accept key is the base64 of the sha1 of the base64 of the client key, and the magic string
+static void CreateAcceptKey(WebsocketConnection* conn, char* accept_key, uint32_t accept_key_size)
+{
+    uint8_t client_key[32 + 40];
+    uint32_t client_key_len = sizeof(client_key);
+    dmCrypt::Base64Encode(conn->m_Key, sizeof(conn->m_Key), client_key, &client_key_len);
 
-    bool upgraded = false;
-    bool valid_key = false;
-    const char* protocol = "";
+    memcpy(client_key + client_key_len, RFC_MAGIC, strlen(RFC_MAGIC));
+    client_key_len += strlen(RFC_MAGIC);
 
-    // TODO: Perhaps also support the Sec-WebSocket-Protocol
+    uint8_t client_key_sha1[20];
+    dmCrypt::HashSha1(client_key, client_key_len, client_key_sha1);
 
-    // parse the headers in place
-    while (r)
+    uint32_t accept_key_len = accept_key_size - 1;
+    dmCrypt::Base64Encode(client_key_sha1, sizeof(client_key_sha1), (uint8_t*)accept_key, &accept_key_len);
+    accept_key[accept_key_len] = 0;
+}
+
+#if defined(HAVE_ZLIB)
+// Parses the parameters of the "permessage-deflate; param; param=value" extension the server accepted
+static Result AcceptDeflate(WebsocketConnection* conn, const char* value, const char* end)
+{
+    bool first = true;
+    while (value < end)
     {
-        // Tokenize the each header line: "Key: Value\r\n"
-        const char* key = r;
-        r = strchr(r, ':');
-        *r = 0;
-        ++r;
-        const char* value = r;
-        while(*value == ' ')
-            ++value;
-        r = strstr(r, "\r\n");
-        *r = 0;
-        r += 2;
+        const char* param_end = (const char*)memchr(value, ';', end - value);
+        if (!param_end)
+            param_end = end;
+
+        const char* name = value;
+        const char* name_end = param_end;
+        while (name < name_end && *name == ' ')
+            ++name;
+        while (name_end > name && name_end[-1] == ' ')
+            --name_end;
+
+        int number = -1;
+        const char* equals = (const char*)memchr(name, '=', name_end - name);
+        if (equals)
+        {
+            const char* digits = equals + 1;
+            while (digits < name_end && (*digits == ' ' || *digits == '"'))
+                ++digits;
+            number = atoi(digits);
+            name_end = equals;
+            while (name_end > name && name_end[-1] == ' ')
+                --name_end;
+        }
+        uint32_t name_len = (uint32_t)(name_end - name);
 
-        if (strcmp(key, "Connection") == 0 && strcmp(value, "Upgrade") == 0)
-            upgraded = true;
-        else if (strcmp(key, "Sec-WebSocket-Accept") == 0)
+        if (first)
+        {
+            if (!TokenEquals(name, name_len, "permessage-deflate"))
+                return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Server enabled an extension that wasn't requested: %.*s", (int)name_len, name);
+            first = false;
+        }
+        else if (TokenEquals(name, name_len, "client_no_context_takeover"))
         {
+            conn->m_DeflateNoContextTakeover = 1;
+        }
+        else if (TokenEquals(name, name_len, "client_max_window_bits"))
+        {
+            // zlib can't produce raw deflate data with a 256 byte window
+            if (number < 9 || number > 15)
+                return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Unsupported permessage-deflate client_max_window_bits: %d", number);
+            if (number < conn->m_DeflateWindowBits)
+                conn->m_DeflateWindowBits = (uint8_t)number;
+        }
+        else if (!TokenEquals(name, name_len, "server_no_context_takeover") && !TokenEquals(name, name_len, "server_max_window_bits"))
+        {
+            return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Unknown permessage-deflate parameter: %.*s", (int)name_len, name);
+        }
 
-            uint8_t client_key[32 + 40];
-            uint32_t client_key_len = sizeof(client_key);
-            dmCrypt::Base64Encode(conn->m_Key, sizeof(conn->m_Key), client_key, &client_key_len);
-            client_key[client_key_len] = 0;
+        value = param_end + 1;
+    }
 
-            memcpy(client_key + client_key_len, RFC_MAGIC, strlen(RFC_MAGIC));
-            client_key_len += strlen(RFC_MAGIC);
-            client_key[client_key_len] = 0;
+    conn->m_DeflateEnabled = 1;
+    return RESULT_OK;
+}
+#endif
 
-            uint8_t client_key_sha1[20];
-            dmCrypt::HashSha1(client_key, client_key_len, client_key_sha1);
+// Parses the response headers found by ReceiveHeaders(), without modifying the buffer.
+// Anything after the headers is websocket data.
+Result VerifyHeaders(WebsocketConnection* conn)
+{
+    const char* r = conn->m_Buffer;
+    const char* end = conn->m_Buffer + conn->m_HeaderLength - 2; // skip the final empty line
 
-            client_key_len = sizeof(client_key);
-            dmCrypt::Base64Encode(client_key_sha1, sizeof(client_key_sha1), client_key, &client_key_len);
-            client_key[client_key_len] = 0;
+    // According to protocol, the response should start with "HTTP/1.1 <statuscode> <message>"
+    const char* http_version_and_status_protocol = "HTTP/1.1 101";
+    if (strncmp(r, http_version_and_status_protocol, strlen(http_version_and_status_protocol)) != 0) {
+        char status_line[128];
+        const char* status_end = (const char*)memchr(r, '\r', end - r);
+        uint32_t status_len = status_end ? (uint32_t)(status_end - r) : 0;
+        dmSnPrintf(status_line, sizeof(status_line), "%.*s", (int)status_len, r);
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Missing: '%s' in header, got '%s'", http_version_and_status_protocol, status_line);
+    }
 
-            if (strcmp(value, (const char*)client_key) == 0)
-                valid_key = true;
-        }
+    bool upgraded = false;
+    bool valid_key = false;
 
-        if (strcmp(r, "\r\n") == 0)
-            break;
+    char accept_key[32];
+    CreateAcceptKey(conn, accept_key, sizeof(accept_key));
+
+    // skip the status line
+    r = (const char*)memchr(r, '\n', end - r) + 1;
+
+    // Each header line: "Key: Value\r\n"
+    HeaderLine header;
+    while (r < end && (r = NextHeaderLine(r, end, &header)) != 0)
+    {
+        if (header.m_Key)
+        {
+            const char* key = header.m_Key;
+            const char* value = header.m_Value;
+            uint32_t key_len = header.m_KeyLength;
+            uint32_t value_len = header.m_ValueLength;
+
+            if (TokenEquals(key, key_len, "Connection") && HasToken(value, value_len, "Upgrade"))
+                upgraded = true;
+            else if (TokenEquals(key, key_len, "Sec-WebSocket-Accept"))
+                valid_key = value_len == strlen(accept_key) && memcmp(value, accept_key, value_len) == 0;
+            else if (TokenEquals(key, key_len, "Sec-WebSocket-Protocol"))
+            {
+                // The server picks a single one of the protocols we offered, if any (RFC 6455 4.1)
+                char protocol[128];
+                bool offered = conn->m_Protocol && value_len < sizeof(protocol) && !memchr(value, ',', value_len);
+                if (offered)
+                {
+                    memcpy(protocol, value, value_len);
+                    protocol[value_len] = 0;
+                    offered = HasToken(conn->m_Protocol, (uint32_t)strlen(conn->m_Protocol), protocol);
+                }
+                if (!offered)
+                    return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Server selected a protocol that wasn't offered: %.*s", (int)value_len, value);
+            }
+            else if (TokenEquals(key, key_len, "Sec-WebSocket-Extensions"))
+            {
+                // We offer at most one extension
+                if (!conn->m_DeflateRequested || conn->m_DeflateEnabled || memchr(value, ',', value_len))
+                    return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Server enabled extensions that weren't requested: %.*s", (int)value_len, value);
+#if defined(HAVE_ZLIB)
+                Result result = AcceptDeflate(conn, value, value + value_len);
+                if (RESULT_OK != result)
+                    return result;
+#endif
+            }
+        }
     }
 
     if (!upgraded)
@@ -229,11 +413,129 @@ Result VerifyHeaders(WebsocketConnection* conn)
         dmLogError("Failed to find valid key in the response headers");
 
     if (!(upgraded && valid_key)) {
-        dmLogError("Response:\n\"%s\"\n", conn->m_Buffer);
+        dmLogError("Response:\n\"%.*s\"\n", (int)conn->m_HeaderLength, conn->m_Buffer);
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Failed verifying handshake headers");
     }
 
-    return (upgraded && valid_key) ? RESULT_OK : RESULT_HANDSHAKE_FAILED;
+    return RESULT_OK;
 }
-#endif
 
-} // namespace
\ No newline at end of file
+// Server side: parses the upgrade request found by ReceiveHeaders(). The key of the client goes into m_Key,
+// and m_Protocol is cleared unless the client offered it
+static Result VerifyRequest(WebsocketConnection* conn)
+{
+    const char* r = conn->m_Buffer;
+    const char* end = conn->m_Buffer + conn->m_HeaderLength - 2; // skip the final empty line
+
+    // "GET <path> HTTP/1.1"
+    const char* line_end = (const char*)memchr(r, '\r', end - r);
+    uint32_t line_len = line_end ? (uint32_t)(line_end - r) : 0;
+    if (line_len < 14 || strncmp(r, "GET ", 4) != 0 || strncmp(line_end - 9, " HTTP/1.1", 9) != 0)
+    {
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Expected an upgrade request, got '%.*s'", (int)(line_len < 128 ? line_len : 128), r);
+    }
+
+    bool upgrade = false;
+    bool connection = false;
+    bool version = false;
+    bool valid_key = false;
+    bool protocol = false;
+
+    // skip the request line
+    r = (const char*)memchr(r, '\n', end - r) + 1;
+
+    HeaderLine header;
+    while (r < end && (r = NextHeaderLine(r, end, &header)) != 0)
+    {
+        if (!header.m_Key)
+            continue;
+
+        const char* key = header.m_Key;
+        const char* value = header.m_Value;
+        uint32_t key_len = header.m_KeyLength;
+        uint32_t value_len = header.m_ValueLength;
+
+        if (TokenEquals(key, key_len, "Upgrade"))
+            upgrade = HasToken(value, value_len, "websocket");
+        else if (TokenEquals(key, key_len, "Connection"))
+            connection = HasToken(value, value_len, "Upgrade");
+        else if (TokenEquals(key, key_len, "Sec-WebSocket-Version"))
+            version = TokenEquals(value, value_len, "13");
+        else if (TokenEquals(key, key_len, "Sec-WebSocket-Key"))
+        {
+            uint8_t key_data[32];
+            uint32_t key_data_len = sizeof(key_data);
+            valid_key = value_len < 32 && dmCrypt::Base64Decode((const uint8_t*)value, value_len, key_data, &key_data_len) && key_data_len == sizeof(conn->m_Key);
+            if (valid_key)
+                memcpy(conn->m_Key, key_data, sizeof(conn->m_Key));
+        }
+        else if (TokenEquals(key, key_len, "Sec-WebSocket-Protocol"))
+            protocol = conn->m_Protocol && HasToken(value, value_len, conn->m_Protocol);
+    }
+
+    if (!(upgrade && connection))
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "The request from %s isn't a websocket upgrade", conn->m_Url.m_Hostname);
+    if (!version)
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "The request from %s isn't for websocket version 13", conn->m_Url.m_Hostname);
+    if (!valid_key)
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "The request from %s has no valid Sec-WebSocket-Key", conn->m_Url.m_Hostname);
+
+    // The protocol is only answered if the client asked for it
+    if (!protocol)
+    {
+        free((void*)conn->m_Protocol);
+        conn->m_Protocol = 0;
+    }
+    return RESULT_OK;
+}
+
+Result AnswerClientHandshake(WebsocketConnection* conn, uint64_t timeout)
+{
+    if (RESULT_OK != VerifyRequest(conn))
+    {
+        // Best effort, the connection is closed either way
+        const char* rejection = "HTTP/1.1 400 Bad Request\r\n"
+                                "Sec-WebSocket-Version: 13\r\n"
+                                "Content-Length: 0\r\n"
+                                "Connection: close\r\n"
+                                "\r\n";
+        SendAll(conn, rejection, (int)strlen(rejection), timeout);
+        return RESULT_HANDSHAKE_FAILED;
+    }
+
+    // The same key the client checks the response for, see VerifyHeaders()
+    char accept_key[32];
+    CreateAcceptKey(conn, accept_key, sizeof(accept_key));
+
+    const char* protocol = conn->m_Protocol ? conn->m_Protocol : "";
+    const char* protocol_header = conn->m_Protocol ? "Sec-WebSocket-Protocol: " : "";
+    const char* protocol_end = conn->m_Protocol ? "\r\n" : "";
+
+    // Extensions aren't offered to clients, so the frames are never compressed
+    char response[512];
+    int length = dmSnPrintf(response, sizeof(response),
+                            "HTTP/1.1 101 Switching Protocols\r\n"
+                            "Upgrade: websocket\r\n"
+                            "Connection: Upgrade\r\n"
+                            "Sec-WebSocket-Accept: %s\r\n"
+                            "%s%s%s"
+                            "\r\n",
+                            accept_key,
+                            protocol_header, protocol, protocol_end);
+    if (length < 0 || (uint32_t)length >= sizeof(response))
+    {
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Handshake response doesn't fit in %u bytes", (uint32_t)sizeof(response));
+    }
+
+    dmSocket::Result sr = SendAll(conn, response, length, timeout);
+    if (sr != dmSocket::RESULT_OK)
+    {
+        return SetStatus(conn, RESULT_HANDSHAKE_FAILED, "Sending the handshake response failed: %s", dmSocket::RESULT_WOULDBLOCK == sr ? "timed out" : dmSocket::ResultToString(sr));
+    }
+
+    return RESULT_OK;
+}
+
+} // namespace
+
+#endif // !__EMSCRIPTEN__
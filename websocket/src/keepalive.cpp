@@ -0,0 +1,89 @@
+#include "websocket.h"
+
+// In emscripten, the browser answers pings, but can't send them
+#if defined(HAVE_WSLAY)
+
+namespace dmWebsocket
+{
+
+// The ping payload is the time it was sent, which the pong echoes back.
+// Only one ping is outstanding at a time, so a round trip longer than the interval delays the next ping
+// instead of making the pong unmatchable.
+
+void StartKeepalive(WebsocketConnection* conn)
+{
+    conn->m_PingTime = dmTime::GetTime();
+    conn->m_PingUnanswered = 0;
+    conn->m_PingOutstanding = 0;
+}
+
+void HandleInbound(WebsocketConnection* conn)
+{
+    // The peer is alive, whether or not it has answered the ping yet, so the timeout starts over
+    if (conn->m_PingOutstanding)
+        conn->m_PingUnanswered = dmTime::GetTime();
+}
+
+Result UpdateKeepalive(WebsocketConnection* conn, uint64_t interval, uint64_t timeout)
+{
+    if (interval == 0)
+        return RESULT_OK;
+
+    uint64_t now = dmTime::GetTime();
+    if (timeout != 0 && conn->m_PingUnanswered != 0 && now - conn->m_PingUnanswered > timeout)
+    {
+        return SetStatus(conn, RESULT_ERROR, "No pong from '%s' within %u ms", conn->m_Url.m_Hostname, (uint32_t)(timeout / 1000));
+    }
+
+    if (conn->m_PingOutstanding || now - conn->m_PingTime < interval)
+        return RESULT_OK;
+
+    struct wslay_event_msg msg;
+    msg.opcode = WSLAY_PING;
+    msg.msg = (const uint8_t*)&now;
+    msg.msg_length = sizeof(now);
+    if (0 != wslay_event_queue_msg(conn->m_Ctx, &msg))
+        return RESULT_OK; // Closing
+
+    conn->m_PingTime = now;
+    conn->m_PingUnanswered = now;
+    conn->m_PingOutstanding = 1;
+    return RESULT_OK;
+}
+
+void HandlePong(WebsocketConnection* conn, const uint8_t* data, uint32_t length)
+{
+    conn->m_PingUnanswered = 0;
+
+    // Any pong answers the outstanding ping, but only an echo of it gives the round trip time
+    bool outstanding = conn->m_PingOutstanding;
+    conn->m_PingOutstanding = 0;
+
+    uint64_t sent;
+    if (!outstanding || length != sizeof(sent))
+        return;
+    memcpy(&sent, data, sizeof(sent));
+    if (sent != conn->m_PingTime)
+        return;
+
+    // Smoothed like the tcp retransmission timer (RFC 6298)
+    uint64_t rtt = dmTime::GetTime() - sent;
+    Stats& stats = conn->m_Stats;
+    if (stats.m_Pongs == 0)
+    {
+        stats.m_Rtt = rtt;
+        stats.m_RttJitter = rtt / 2;
+    }
+    else
+    {
+        uint64_t delta = stats.m_Rtt > rtt ? stats.m_Rtt - rtt : rtt - stats.m_Rtt;
+        stats.m_RttJitter = (3 * stats.m_RttJitter + delta) / 4;
+        stats.m_Rtt = (7 * stats.m_Rtt + rtt) / 8;
+    }
+    stats.m_LastRtt = rtt;
+    ++stats.m_Pongs;
+}
+
+} // namespace
+
+#endif // HAVE_WSLAY
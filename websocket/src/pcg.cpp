@@ -1,3 +1,9 @@
+#if defined(_WIN32)
+    #define _CRT_RAND_S // for rand_s()
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "websocket.h"
 
 // https://www.pcg-random.org/using-pcg-c-basic.html
@@ -21,4 +27,55 @@ namespace dmWebsocket
         rng->state += initstate;
         pcg32_random_r(rng);
     }
-}
\ No newline at end of file
+
+    // Fills the buffer from the OS entropy source. Returns false if there isn't one
+    static bool GetEntropy(void* buffer, uint32_t size)
+    {
+#if defined(_WIN32)
+        uint8_t* out = (uint8_t*)buffer;
+        for (uint32_t i = 0; i < size; i += sizeof(unsigned int))
+        {
+            unsigned int value;
+            if (rand_s(&value) != 0)
+                return false;
+            uint32_t n = size - i < sizeof(value) ? size - i : sizeof(value);
+            memcpy(out + i, &value, n);
+        }
+        return true;
+#elif defined(__APPLE__)
+        arc4random_buf(buffer, size);
+        return true;
+#elif defined(__linux__) || defined(__ANDROID__)
+        FILE* f = fopen("/dev/urandom", "rb");
+        if (!f)
+            return false;
+        bool ok = fread(buffer, 1, size, f) == size;
+        fclose(f);
+        return ok;
+#else
+        return false;
+#endif
+    }
+
+    void pcg32_srandom_entropy_r(pcg32_random_t* rng)
+    {
+        uint64_t seed[2];
+        if (!GetEntropy(seed, sizeof(seed)))
+        {
+            // No entropy source; at least make connections created at the same time differ
+            seed[0] = dmTime::GetTime();
+            seed[1] = (uint64_t)(uintptr_t)rng;
+        }
+        pcg32_srandom_r(rng, seed[0], seed[1]);
+    }
+
+    void pcg32_random_bytes_r(pcg32_random_t* rng, uint8_t* buffer, uint32_t size)
+    {
+        for (uint32_t i = 0; i < size; i += 4)
+        {
+            uint32_t value = pcg32_random_r(rng);
+            uint32_t n = size - i < 4 ? size - i : 4;
+            memcpy(buffer + i, &value, n);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <dmsdk/dlib/atomic.h>
+
+namespace dmWebsocket
+{
+    // Bounded, lock-free queue of pointers between exactly one producer thread and one consumer thread.
+    // The struct may be zero initialized, and must be given a capacity before use.
+    template <typename T>
+    struct RingBuffer
+    {
+        T**             m_Items;
+        uint32_t        m_Mask;
+        int32_atomic_t  m_Head;     // Next slot to read. Only written by the consumer
+        int32_atomic_t  m_Tail;     // Next slot to write. Only written by the producer
+
+        // Not thread safe. The capacity is rounded up to a power of two
+        void SetCapacity(uint32_t capacity)
+        {
+            uint32_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+            free((void*)m_Items);
+            m_Items = (T**)malloc(sizeof(T*) * size);
+            m_Mask = size - 1;
+            dmAtomicStore32(&m_Head, 0);
+            dmAtomicStore32(&m_Tail, 0);
+        }
+
+        // Not thread safe. Any remaining items are left to the caller
+        void Free()
+        {
+            free((void*)m_Items);
+            m_Items = 0;
+            m_Mask = 0;
+        }
+
+        // Producer only. The value returned is a lower bound of the actual number of free slots
+        uint32_t Available()
+        {
+            uint32_t head = (uint32_t)dmAtomicGet32(&m_Head);
+            uint32_t tail = (uint32_t)dmAtomicGet32(&m_Tail);
+            return (m_Mask + 1) - (tail - head);
+        }
+
+        // Producer only
+        bool Push(T* item)
+        {
+            uint32_t head = (uint32_t)dmAtomicGet32(&m_Head);
+            uint32_t tail = (uint32_t)dmAtomicGet32(&m_Tail);
+            if (tail - head > m_Mask)
+                return false;
+            m_Items[tail & m_Mask] = item;
+            dmAtomicStore32(&m_Tail, (int32_t)(tail + 1)); // publishes the item
+            return true;
+        }
+
+        // Consumer only. The producer may add an item right after
+        bool Empty()
+        {
+            return dmAtomicGet32(&m_Head) == dmAtomicGet32(&m_Tail);
+        }
+
+        // Consumer only
+        bool Pop(T** item)
+        {
+            uint32_t head = (uint32_t)dmAtomicGet32(&m_Head);
+            uint32_t tail = (uint32_t)dmAtomicGet32(&m_Tail);
+            if (head == tail)
+                return false;
+            *item = m_Items[head & m_Mask];
+            dmAtomicStore32(&m_Head, (int32_t)(head + 1)); // releases the slot
+            return true;
+        }
+    };
+}
@@ -76,4 +76,19 @@ char* luaL_checktable_string(lua_State *L, int numArg, const char* field, char*
     return result;
 }
 
+bool luaL_checktable_bool(lua_State *L, int numArg, const char* field, bool def)
+{
+    bool result = def;
+    if(lua_istable(L, numArg))
+    {
+        lua_getfield(L, numArg, field);
+        if(!lua_isnil(L, -1))
+        {
+            result = luaL_checkbool(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return result;
+}
+
 } // namespace
\ No newline at end of file
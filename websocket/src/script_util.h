@@ -9,4 +9,5 @@ namespace dmWebsocket {
     char*       luaL_checkstringd(lua_State *L, int numArg, const char* def);
     lua_Number  luaL_checktable_number(lua_State *L, int numArg, const char* field, lua_Number def);
     char*       luaL_checktable_string(lua_State *L, int numArg, const char* field, char* def);
+    bool        luaL_checktable_bool(lua_State *L, int numArg, const char* field, bool def);
 } // namespace
\ No newline at end of file
@@ -15,42 +15,121 @@ dmSocket::Result WaitForSocket(WebsocketConnection* conn, dmSocket::SelectorKind
 
 dmSocket::Result Send(WebsocketConnection* conn, const char* buffer, int length, int* out_sent_bytes)
 {
-    int total_sent_bytes = 0;
     int sent_bytes = 0;
+    dmSocket::Result r;
+
+    if (conn->m_SSLSocket)
+        r = dmSSLSocket::Send(conn->m_SSLSocket, buffer, length, &sent_bytes);
+    else
+        r = dmSocket::Send(conn->m_Socket, buffer, length, &sent_bytes);
 
-    while (total_sent_bytes < length) {
-        dmSocket::Result r;
+    if (r == dmSocket::RESULT_TRY_AGAIN)
+        r = dmSocket::RESULT_WOULDBLOCK;
 
-        if (conn->m_SSLSocket)
-            r = dmSSLSocket::Send(conn->m_SSLSocket, buffer + total_sent_bytes, length - total_sent_bytes, &sent_bytes);
-        else
-            r = dmSocket::Send(conn->m_Socket, buffer + total_sent_bytes, length - total_sent_bytes, &sent_bytes);
+    if (r != dmSocket::RESULT_OK)
+        sent_bytes = 0;
+    conn->m_Stats.m_BytesSent += sent_bytes;
 
-        if( r == dmSocket::RESULT_WOULDBLOCK )
+    if (out_sent_bytes)
+        *out_sent_bytes = sent_bytes;
+    return r;
+}
+
+dmSocket::Result SendAll(WebsocketConnection* conn, const char* buffer, int length, uint64_t timeout)
+{
+    // A peer that stops reading mustn't hold up the update
+    uint64_t deadline = dmTime::GetTime() + timeout;
+    int total_sent_bytes = 0;
+    while (total_sent_bytes < length)
+    {
+        int sent_bytes = 0;
+        dmSocket::Result r = Send(conn, buffer + total_sent_bytes, length - total_sent_bytes, &sent_bytes);
+
+        if (r == dmSocket::RESULT_WOULDBLOCK)
         {
-            r = dmSocket::RESULT_TRY_AGAIN;
+            uint64_t now = dmTime::GetTime();
+            if (now >= deadline)
+                return dmSocket::RESULT_WOULDBLOCK;
+            // Sleep until the socket has room again, instead of spinning
+            uint64_t wait = deadline - now < (uint64_t)SOCKET_WAIT_TIMEOUT ? deadline - now : (uint64_t)SOCKET_WAIT_TIMEOUT;
+            r = WaitForSocket(conn, dmSocket::SELECTOR_KIND_WRITE, (int)wait);
+            if (r == dmSocket::RESULT_WOULDBLOCK)
+                continue;
         }
 
-        if (r == dmSocket::RESULT_TRY_AGAIN)
-            continue;
-
-        if (r != dmSocket::RESULT_OK) {
+        if (r != dmSocket::RESULT_OK)
             return r;
-        }
 
         total_sent_bytes += sent_bytes;
     }
-    if (out_sent_bytes)
-        *out_sent_bytes = total_sent_bytes;
     return dmSocket::RESULT_OK;
 }
 
+void CloseSocket(WebsocketConnection* conn)
+{
+#if defined(__EMSCRIPTEN__)
+    BrowserClose(conn);
+#endif
+
+    if (conn->m_SSLSocket)
+    {
+        dmSSLSocket::Delete(conn->m_SSLSocket);
+        conn->m_SSLSocket = dmSSLSocket::INVALID_SOCKET_HANDLE;
+    }
+
+    if (conn->m_Socket != dmSocket::INVALID_SOCKET_HANDLE)
+    {
+        // We would normally do a shutdown() first, but Emscripten returns ENOSYS
+#if !defined(__EMSCRIPTEN__)
+        dmSocket::Shutdown(conn->m_Socket, dmSocket::SHUTDOWNTYPE_READWRITE);
+#endif
+        dmSocket::Delete(conn->m_Socket);
+        conn->m_Socket = dmSocket::INVALID_SOCKET_HANDLE;
+    }
+}
+
+#if !defined(__EMSCRIPTEN__)
+dmSocket::Result OpenListenSocket(const char* host, uint16_t port, dmSocket::Socket* out_socket)
+{
+    dmSocket::Address address;
+    dmSocket::Result r = dmSocket::GetHostByName(host, &address, true, true);
+    if (r != dmSocket::RESULT_OK)
+        return r;
+
+    dmSocket::Socket socket;
+    r = dmSocket::New(address.m_family, dmSocket::TYPE_STREAM, dmSocket::PROTOCOL_TCP, &socket);
+    if (r != dmSocket::RESULT_OK)
+        return r;
+
+    // So a restarted game can listen on the same port right away
+    dmSocket::SetReuseAddress(socket, true);
+    r = dmSocket::Bind(socket, address, port);
+    if (r == dmSocket::RESULT_OK)
+        r = dmSocket::Listen(socket, 16);
+    if (r == dmSocket::RESULT_OK)
+        r = dmSocket::SetBlocking(socket, false);
+    if (r != dmSocket::RESULT_OK)
+    {
+        dmSocket::Delete(socket);
+        return r;
+    }
+
+    *out_socket = socket;
+    return dmSocket::RESULT_OK;
+}
+#endif
+
 dmSocket::Result Receive(WebsocketConnection* conn, void* buffer, int length, int* received_bytes)
 {
+    dmSocket::Result r;
     if (conn->m_SSLSocket)
-        return dmSSLSocket::Receive(conn->m_SSLSocket, buffer, length, received_bytes);
+        r = dmSSLSocket::Receive(conn->m_SSLSocket, buffer, length, received_bytes);
     else
-        return dmSocket::Receive(conn->m_Socket, buffer, length, received_bytes);
+        r = dmSocket::Receive(conn->m_Socket, buffer, length, received_bytes);
+
+    if (r == dmSocket::RESULT_OK)
+        conn->m_Stats.m_BytesReceived += *received_bytes;
+    return r;
 }
 
 } // namespace
\ No newline at end of file
@@ -6,29 +6,92 @@
 
 #include "websocket.h"
 #include "script_util.h"
-#include <dmsdk/dlib/connection_pool.h>
-#include <dmsdk/dlib/dns.h>
 #include <dmsdk/dlib/sslsocket.h>
-
-#if defined(__EMSCRIPTEN__)
-#include <emscripten/emscripten.h> // for EM_ASM
-#endif
+#include <dmsdk/dlib/thread.h>
+#include <dmsdk/dlib/mutex.h>
+#include <dmsdk/dlib/condition_variable.h>
 
 namespace dmWebsocket {
 
+// Time the network thread sleeps between updates (us)
+static const uint32_t NETWORK_THREAD_SLEEP = 1000;
+// Once all connections have been idle this long (us), the network thread waits for their sockets instead,
+// for at most NETWORK_THREAD_IDLE_WAIT (us), which is then also the longest a send waits
+static const uint64_t NETWORK_THREAD_IDLE_DELAY = 100 * 1000;
+static const uint32_t NETWORK_THREAD_IDLE_WAIT = 10 * 1000;
+// Sockets per select call. Winsock only takes 64 sockets per set
+static const uint32_t SELECT_MAX_SOCKETS = 64;
+// Connections a server takes per update, so a burst of clients doesn't stall the frame
+static const uint32_t MAX_ACCEPTS_PER_UPDATE = 16;
+// Message buffers kept per connection, so a batch with up to this many messages doesn't create any
+static const uint32_t MAX_POOLED_MESSAGE_BUFFERS = 8;
+
+// Connections and servers are handed to Lua as handles, with the slot index in the low bits and the generation
+// of the slot in the high bits. Destroying a connection or closing a server bumps the generation, so stale handles
+// are rejected. Both share the slots, so a server handle never finds a connection, and the other way around
+static const uint32_t HANDLE_INDEX_BITS = 16;
+static const uint32_t HANDLE_INDEX_MASK = (1 << HANDLE_INDEX_BITS) - 1;
+
+struct WebsocketServer;
+
+struct HandleSlot
+{
+    WebsocketConnection*    m_Connection;
+    WebsocketServer*        m_Server;
+    uint16_t                m_Generation;   // Never 0, so a handle is never 0
+};
+
+// A socket accepting connections, see websocket.listen(). Script side only
+struct WebsocketServer
+{
+    dmScript::LuaCallbackInfo*      m_Callback;         // Shared by the accepted connections
+    dmSocket::Socket                m_Socket;
+    uint16_t                        m_Port;
+    uint32_t                        m_RefCount;         // The listening socket, and each accepted connection
+    uint32_t                        m_Handle;           // The handle given to Lua, see FindServer()
+    char*                           m_Protocol;         // The Sec-WebSocket-Protocol to answer, if a client offers it
+    // Options for the accepted connections, as for websocket.connect()
+    uint32_t                        m_BatchMessages:1;
+    uint32_t                        m_MessageBuffers:1;
+    uint32_t                        m_PositionalCallback:1;
+    uint8_t                         m_Cork;
+    DataType                        m_DataType;
+    uint32_t                        m_ChunkSize;
+};
 
 struct WebsocketContext
 {
     uint64_t                        m_BufferSize;
+    uint32_t                        m_RecvBufferSize;   // The wslay frame buffers of each connection
+    uint32_t                        m_SendBufferSize;
     int                             m_Timeout;
-    dmArray<WebsocketConnection*>   m_Connections;
-    dmConnectionPool::HPool         m_Pool;
-    dmDNS::HChannel                 m_Channel;
+    uint64_t                        m_PingInterval;     // (us) 0 if disabled
+    uint64_t                        m_PingTimeout;      // (us) 0 if disabled
+    uint64_t                        m_MaxPollTime;      // (us) Network side time per update, 0 if unlimited
+    uint32_t                        m_MaxMessages;      // Messages delivered to the scripts per update, 0 if unlimited
+    uint32_t                        m_MaxConnections;   // Open connections made with websocket.connect(), 0 if unlimited
+    uint64_t                        m_BufferIdleTime;   // (us) Idle time after which the buffers of a connection are released, 0 if never
+    uint64_t                        m_ReconnectDelay;   // (us) Before the first reconnect attempt, doubled for each failed attempt
+    uint64_t                        m_ReconnectMaxDelay;    // (us)
+    uint32_t                        m_NetStart;         // Network side: the connection to update first, so none is starved
+    uint32_t                        m_ScriptStart;      // Script side: the connection to dispatch first
+    dmArray<WebsocketConnection*>   m_Connections;      // Script side
+    dmArray<HandleSlot>             m_Slots;            // Script side, indexed by the connection and server handles
+    dmArray<uint16_t>               m_FreeSlots;        // Script side
+    dmArray<WebsocketServer*>       m_Servers;          // Script side, the ones still listening
+    dmArray<WebsocketConnection*>   m_NetConnections;   // Network side
+    dmArray<WebsocketConnection*>   m_NewConnections;   // Waiting to be picked up by the network thread, protected by m_Mutex
+    dmThread::Thread                m_Thread;
+    dmMutex::HMutex                 m_Mutex;
+    dmConditionVariable::HConditionVariable m_Wake; // Signaled when a connection is started, or the thread stops
+    int32_atomic_t                  m_ThreadRunning;
     uint32_t                        m_Initialized:1;
+    uint32_t                        m_Threaded:1;
 } g_Websocket;
 
 
-static void HandleCallback(WebsocketConnection* conn, int event);
+static void HandleCallback(WebsocketConnection* conn, int event, Message* const* messages, uint32_t num_messages);
+static void HandleMessages(WebsocketConnection* conn);
 
 
 #define STRING_CASE(_X) case _X: return #_X;
@@ -50,10 +113,15 @@ const char* StateToString(State err)
 {
     switch(err) {
         STRING_CASE(STATE_CONNECTING);
+        STRING_CASE(STATE_RESOLVING);
+        STRING_CASE(STATE_TCP_CONNECTING);
+        STRING_CASE(STATE_TLS_HANDSHAKE);
         STRING_CASE(STATE_HANDSHAKE_WRITE);
         STRING_CASE(STATE_HANDSHAKE_READ);
         STRING_CASE(STATE_CONNECTED);
+        STRING_CASE(STATE_CLOSING);
         STRING_CASE(STATE_DISCONNECTED);
+        STRING_CASE(STATE_RECONNECT_WAIT);
         default: return "Unknown error";
     };
 }
@@ -68,12 +136,32 @@ const char* StateToString(State err)
     CloseConnection(conn);
 
 
-static void SetState(WebsocketConnection* conn, State state)
+void SetState(WebsocketConnection* conn, State state)
 {
     State prev_state = conn->m_State;
     if (prev_state != state)
     {
+        uint64_t now = dmTime::GetTime();
+        uint64_t elapsed = now - conn->m_StateStart;
+        switch (prev_state)
+        {
+            case STATE_CONNECTING:
+            case STATE_RESOLVING:
+            case STATE_TCP_CONNECTING:  conn->m_Stats.m_ConnectTime += elapsed; break;
+            case STATE_TLS_HANDSHAKE:   conn->m_Stats.m_TlsTime += elapsed; break;
+            case STATE_HANDSHAKE_WRITE:
+            case STATE_HANDSHAKE_READ:  conn->m_Stats.m_HttpTime += elapsed; break;
+            default: break;
+        }
+        conn->m_StateStart = now;
         conn->m_State = state;
+        if (STATE_CONNECTED == state)
+        {
+            // A drop from now on reconnects, with a fresh number of attempts
+            conn->m_WasConnected = 1;
+            conn->m_Reconnecting = 0;
+            conn->m_ReconnectAttempts = 0;
+        }
         WS_DEBUG("%s -> %s", StateToString(prev_state), StateToString(conn->m_State));
     }
 }
@@ -85,118 +173,1825 @@ Result SetStatus(WebsocketConnection* conn, Result status, const char* format, .
     {
         va_list lst;
         va_start(lst, format);
+        int length = vsnprintf(0, 0, format, lst);
+        va_end(lst);
+
+        // Messages that don't fit in the biggest buffer are truncated
+        uint32_t size = length >= 0 ? (uint32_t)length + 1 : BUFFER_INITIAL_SIZE;
+        GrowBuffer(conn, size < conn->m_MaxMessageSize ? size : conn->m_MaxMessageSize);
 
-        conn->m_BufferSize = vsnprintf(conn->m_Buffer, conn->m_BufferCapacity, format, lst);
+        va_start(lst, format);
+        int written = conn->m_Buffer ? vsnprintf(conn->m_Buffer, conn->m_BufferCapacity, format, lst) : 0;
         va_end(lst);
+        // vsnprintf() returns the untruncated length
+        if (written < 0)
+            written = 0;
+        conn->m_BufferSize = conn->m_BufferCapacity && (uint32_t)written >= conn->m_BufferCapacity ? (int)conn->m_BufferCapacity - 1 : written;
         conn->m_Status = status;
     }
     return status;
 }
 
+bool GrowBuffer(WebsocketConnection* conn, uint32_t size)
+{
+    if (size <= conn->m_BufferCapacity)
+        return true;
+
+    uint32_t capacity = conn->m_BufferCapacity ? conn->m_BufferCapacity : BUFFER_INITIAL_SIZE;
+    while (capacity < size && capacity < conn->m_MaxMessageSize)
+        capacity *= 2;
+    if (capacity > conn->m_MaxMessageSize)
+        capacity = conn->m_MaxMessageSize;
+
+    if (capacity > conn->m_BufferCapacity)
+    {
+        // Out of memory, the buffer is kept as is
+        char* buffer = (char*)realloc(conn->m_Buffer, capacity);
+        if (!buffer)
+            return false;
+        conn->m_Buffer = buffer;
+        conn->m_BufferCapacity = capacity;
+    }
+    return size <= capacity;
+}
+
+void FitBuffer(WebsocketConnection* conn)
+{
+    if (conn->m_BufferSize <= 0)
+    {
+        free((void*)conn->m_Buffer);
+        conn->m_Buffer = 0;
+        conn->m_BufferSize = 0;
+        conn->m_BufferCapacity = 0;
+        return;
+    }
+
+    // Room for the terminating null character
+    uint32_t capacity = (uint32_t)conn->m_BufferSize + 1;
+    if (capacity < conn->m_BufferCapacity)
+    {
+        // If it can't be shrunk, the bigger buffer is kept
+        char* buffer = (char*)realloc(conn->m_Buffer, capacity);
+        if (!buffer)
+            return;
+        conn->m_Buffer = buffer;
+        conn->m_BufferCapacity = capacity;
+    }
+}
+
+Message* NewMessage(uint32_t event, const void* data, uint32_t length)
+{
+    // The payload is stored right after the header, with room for a terminating null character
+    Message* msg = (Message*)malloc(sizeof(Message) + length + 1);
+    if (!msg)
+        return 0;
+    msg->m_Length = length;
+    msg->m_Event = event;
+    char* msg_data = (char*)(msg + 1);
+    if (length)
+        memcpy(msg_data, data, length);
+    msg_data[length] = 0;
+    return msg;
+}
+
+Message* ResizeMessage(Message* msg, uint32_t capacity)
+{
+    Message* resized = (Message*)realloc((void*)msg, sizeof(Message) + capacity + 1);
+    if (!resized)
+        return 0;
+    if (!msg)
+    {
+        resized->m_Length = 0;
+        resized->m_Event = EVENT_MESSAGE;
+    }
+    return resized;
+}
+
+void FreeMessage(Message* msg)
+{
+    free((void*)msg);
+}
+
+// Keeps the messages in order: once one message is pending, all following messages are too
+static void PushOrDefer(RingBuffer<Message>& ring, dmArray<Message*>& pending, Message* msg)
+{
+    if (pending.Empty() && ring.Push(msg))
+        return;
+    if (pending.Full())
+        pending.OffsetCapacity(16);
+    pending.Push(msg);
+}
+
+// Returns true if all pending messages made it into the ring buffer
+static bool FlushPending(RingBuffer<Message>& ring, dmArray<Message*>& pending)
+{
+    uint32_t size = pending.Size();
+    uint32_t count = 0;
+    while (count < size && ring.Push(pending[count]))
+        ++count;
+    if (count > 0)
+    {
+        memmove(pending.Begin(), pending.Begin() + count, sizeof(Message*) * (size - count));
+        pending.SetSize(size - count);
+    }
+    return pending.Empty();
+}
+
+static void FreeMessages(RingBuffer<Message>& ring, dmArray<Message*>& pending)
+{
+    Message* msg;
+    while (ring.Pop(&msg))
+        FreeMessage(msg);
+    ring.Free();
+
+    for (uint32_t i = 0; i < pending.Size(); ++i)
+        FreeMessage(pending[i]);
+    pending.SetCapacity(0);
+}
+
+bool PushEvent(WebsocketConnection* conn, Event event, const void* data, uint32_t length)
+{
+    Message* msg = NewMessage(event, data, length);
+    if (!msg)
+    {
+        dmLogError("Out of memory receiving a message of %u bytes", length);
+        return false;
+    }
+    PushOrDefer(conn->m_Inbound, conn->m_InboundPending, msg);
+    return true;
+}
+
+void PushMessage(WebsocketConnection* conn, Message* msg)
+{
+    PushOrDefer(conn->m_Inbound, conn->m_InboundPending, msg);
+}
+
 // ***************************************************************************************************
-// LUA functions
+// Network side
+
+static void CloseConnection(WebsocketConnection* conn)
+{
+    // we want it to send this message in the polling
+    if (conn->m_State == STATE_CONNECTED) {
+#if defined(HAVE_WSLAY)
+        WSL_Close(conn->m_Ctx);
+#endif
+    }
 
+    SetState(conn, STATE_DISCONNECTED);
+}
 
+// Closes a connection the script is done with. What's already queued is sent before the close frame,
+// see UpdateConnection(). Other states have nothing to send, and disconnect right away
+static void StartClosing(WebsocketConnection* conn)
+{
+#if defined(HAVE_WSLAY)
+    if (conn->m_State == STATE_CONNECTED) {
+        conn->m_CloseQueued = 0;
+        SetState(conn, STATE_CLOSING);
+        return;
+    }
+#endif
+    CloseConnection(conn);
+}
 
-static WebsocketConnection* CreateConnection(const char* url)
+#if defined(HAVE_WSLAY)
+static uint8_t GetOpcode(DataType type)
 {
-    WebsocketConnection* conn = (WebsocketConnection*)malloc(sizeof(WebsocketConnection));
-    memset(conn, 0, sizeof(WebsocketConnection));
-    conn->m_BufferCapacity = g_Websocket.m_BufferSize;
-    conn->m_Buffer = (char*)malloc(conn->m_BufferCapacity);
+    return DATA_TYPE_TEXT == type ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME;
+}
+#endif
 
-    dmURI::Parts uri;
-    dmURI::Parse(url, &conn->m_Url);
+static void QueueMessage(WebsocketConnection* conn, const char* data, uint32_t length, DataType type)
+{
+#if defined(HAVE_WSLAY)
+    struct wslay_event_msg msg;
+    msg.opcode = GetOpcode(type);
+    msg.msg = (const uint8_t*)data;
+    msg.msg_length = length;
 
-    if (strcmp(conn->m_Url.m_Scheme, "https") == 0)
-        strcpy(conn->m_Url.m_Scheme, "wss");
+    uint8_t rsv = WSLAY_RSV_NONE;
+#if defined(HAVE_ZLIB)
+    if (DeflateCompress(conn, data, length, &msg.msg, &length))
+    {
+        msg.msg_length = length;
+        rsv = WSLAY_RSV1_BIT;
+    }
+#endif
 
-    conn->m_SSL = strcmp(conn->m_Url.m_Scheme, "wss") == 0 ? 1 : 0;
-    conn->m_State = STATE_CONNECTING;
+    if (0 == wslay_event_queue_msg_ex(conn->m_Ctx, &msg, rsv)) // it makes a copy of the data
+        ++conn->m_Stats.m_MessagesSent;
+#else
+    if (!BrowserSend(conn, data, length, type))
+    {
+        CLOSE_CONN("Failed to send on websocket");
+        return;
+    }
+    ++conn->m_Stats.m_MessagesSent;
+#endif
+}
 
-    return conn;
+#if defined(HAVE_WSLAY)
+// Queues a buffer without copying it. wslay reads it one fragment at a time as the socket accepts more data.
+// The fragments aren't compressed, which permessage-deflate allows per message
+static void QueueSendSource(WebsocketConnection* conn, SendSource* source)
+{
+    struct wslay_event_fragmented_msg msg;
+    msg.opcode = GetOpcode(source->m_DataType);
+    msg.source.data = source;
+    msg.read_callback = WSL_ReadSendSourceCallback;
+
+    if (0 != wslay_event_queue_fragmented_msg(conn->m_Ctx, &msg))
+    {
+        dmAtomicStore32(&source->m_Done, 1);
+        return;
+    }
+    if (conn->m_QueuedSources.Full())
+        conn->m_QueuedSources.OffsetCapacity(4);
+    conn->m_QueuedSources.Push(source);
+    conn->m_SendSourceBytes += source->m_Size;
+    ++conn->m_Stats.m_MessagesSent;
 }
 
-static void DestroyConnection(WebsocketConnection* conn)
+// Bigger low priority messages go out as fragments read straight from the queued copy
+static const uint32_t LOW_PRIORITY_FRAGMENT_SIZE = 4 * 1024;
+
+static uint32_t GetOutboundSize(const Message* msg)
+{
+    if (OUTBOUND_SEND_SOURCE != msg->m_Event)
+        return msg->m_Length;
+    SendSource* source;
+    memcpy(&source, GetMessageData(msg), sizeof(source));
+    return source->m_Size;
+}
+
+// Holds a message back until wslay has nothing else to send. The lane takes ownership
+static void QueueLowPriority(WebsocketConnection* conn, Message* msg)
+{
+    if (conn->m_LowPriority.Full())
+        conn->m_LowPriority.OffsetCapacity(8);
+    conn->m_LowPriority.Push(msg);
+    conn->m_LowPriorityBytes += GetOutboundSize(msg);
+}
+
+// Hands the next low priority message to wslay, once its send queue is empty. A websocket message can't be
+// interleaved with the frames of another one, so a message sent at high priority waits for at most the low
+// priority message that's already going out. Returns true if a message was queued
+static bool FeedLowPriority(WebsocketConnection* conn)
+{
+    if (conn->m_LowPriorityFirst == conn->m_LowPriority.Size() || conn->m_CorkSize != 0 || wslay_event_get_queued_msg_count(conn->m_Ctx) != 0)
+        return false;
+
+    Message* msg = conn->m_LowPriority[conn->m_LowPriorityFirst++];
+    if (conn->m_LowPriorityFirst == conn->m_LowPriority.Size())
+    {
+        conn->m_LowPriority.SetSize(0);
+        conn->m_LowPriorityFirst = 0;
+    }
+
+    if (OUTBOUND_SEND_SOURCE == msg->m_Event)
+    {
+        SendSource* source;
+        memcpy(&source, GetMessageData(msg), sizeof(source));
+        conn->m_LowPriorityBytes -= source->m_Size;
+        QueueSendSource(conn, source);
+        FreeMessage(msg);
+        return true;
+    }
+
+    DataType type = OUTBOUND_TEXT_MESSAGE == msg->m_Event ? DATA_TYPE_TEXT : DATA_TYPE_BINARY;
+    if (msg->m_Length <= LOW_PRIORITY_FRAGMENT_SIZE)
+    {
+        conn->m_LowPriorityBytes -= msg->m_Length;
+        QueueMessage(conn, GetMessageData(msg), msg->m_Length, type);
+        FreeMessage(msg);
+        return true;
+    }
+
+    // Pings and pongs still go out between the fragments
+    struct wslay_event_fragmented_msg fragmented;
+    fragmented.opcode = GetOpcode(type);
+    fragmented.source.data = msg;
+    fragmented.read_callback = WSL_ReadLowPriorityCallback;
+    if (0 != wslay_event_queue_fragmented_msg(conn->m_Ctx, &fragmented))
+    {
+        conn->m_LowPriorityBytes -= msg->m_Length;
+        FreeMessage(msg);
+        return true;
+    }
+    conn->m_LowMessage = msg;
+    conn->m_LowOffset = 0;
+    ++conn->m_Stats.m_MessagesSent;
+    return true;
+}
+
+// Drops the low priority messages that haven't gone out
+static void ClearLowPriority(WebsocketConnection* conn)
+{
+    for (uint32_t i = conn->m_LowPriorityFirst; i < conn->m_LowPriority.Size(); ++i)
+    {
+        Message* msg = conn->m_LowPriority[i];
+        if (OUTBOUND_SEND_SOURCE == msg->m_Event)
+        {
+            SendSource* source;
+            memcpy(&source, GetMessageData(msg), sizeof(source));
+            dmAtomicStore32(&source->m_Done, 1);
+        }
+        FreeMessage(msg);
+    }
+    conn->m_LowPriority.SetSize(0);
+    conn->m_LowPriorityFirst = 0;
+    conn->m_LowPriorityBytes = 0;
+    if (conn->m_LowMessage)
+    {
+        FreeMessage(conn->m_LowMessage);
+        conn->m_LowMessage = 0;
+    }
+}
+
+// Network side: the bytes queued in wslay, in the lanes, and corked but not yet written
+static uint32_t GetQueuedLength(WebsocketConnection* conn)
+{
+    if (!conn->m_Ctx)
+        return 0;
+    return (uint32_t)wslay_event_get_queued_msg_length(conn->m_Ctx) + conn->m_SendSourceBytes + conn->m_LowPriorityBytes + conn->m_CorkSize;
+}
+#endif
+
+// Publishes the number of bytes waiting to be sent, for websocket.get_buffered_amount() (threaded mode)
+static void UpdateBufferedAmount(WebsocketConnection* conn)
+{
+#if defined(HAVE_WSLAY)
+    if (g_Websocket.m_Threaded)
+        dmAtomicStore32(&conn->m_BufferedAmount, (int32_t)GetQueuedLength(conn));
+#endif
+}
+
+// Whether a connection that dropped should connect again, instead of being handed back
+static bool ShouldReconnect(WebsocketConnection* conn)
+{
+    if (!conn->m_Reconnect || !conn->m_WasConnected || dmAtomicGet32(&conn->m_CloseRequested))
+        return false;
+    return conn->m_MaxReconnectAttempts == 0 || conn->m_ReconnectAttempts < conn->m_MaxReconnectAttempts;
+}
+
+// Takes the messages and close requests queued by the script side (threaded mode, or reconnecting connections)
+static void ProcessOutbound(WebsocketConnection* conn)
+{
+    // Messages sent during an outage wait in the queue until the connection is back, unless it's being closed
+    bool closing = dmAtomicGet32(&conn->m_CloseRequested) != 0;
+    if (!closing && (conn->m_Reconnecting || (STATE_DISCONNECTED == conn->m_State && ShouldReconnect(conn))))
+        return;
+
+    Message* msg;
+    while (conn->m_Outbound.Pop(&msg))
+    {
+        uint32_t length = msg->m_Length;
+#if defined(HAVE_WSLAY)
+        if ((msg->m_Event & OUTBOUND_LOW_PRIORITY) && STATE_CONNECTED == conn->m_State)
+        {
+            msg->m_Event &= ~OUTBOUND_LOW_PRIORITY;
+            QueueLowPriority(conn, msg);
+            UpdateBufferedAmount(conn);
+            dmAtomicSub32(&conn->m_OutboundBytes, (int32_t)GetOutboundSize(msg));
+            continue;
+        }
+#endif
+        msg->m_Event &= ~OUTBOUND_LOW_PRIORITY;
+        if (EVENT_DISCONNECTED == msg->m_Event)
+        {
+            StartClosing(conn);
+        }
+        else if (OUTBOUND_SEND_SOURCE == msg->m_Event)
+        {
+            SendSource* source;
+            memcpy(&source, GetMessageData(msg), sizeof(source));
+            length = source->m_Size;
+#if defined(HAVE_WSLAY)
+            if (STATE_CONNECTED == conn->m_State)
+                QueueSendSource(conn, source);
+            else
+#endif
+                dmAtomicStore32(&source->m_Done, 1);
+        }
+        else if (STATE_CONNECTED == conn->m_State)
+        {
+            QueueMessage(conn, GetMessageData(msg), msg->m_Length, OUTBOUND_TEXT_MESSAGE == msg->m_Event ? DATA_TYPE_TEXT : DATA_TYPE_BINARY);
+        }
+        UpdateBufferedAmount(conn);
+        dmAtomicSub32(&conn->m_OutboundBytes, (int32_t)length);
+        FreeMessage(msg);
+    }
+}
+
+// Queues the error message of the connection, if there is one, or an empty payload
+static void PushStatus(WebsocketConnection* conn, Event event)
+{
+    if (RESULT_OK == conn->m_Status)
+    {
+        PushEvent(conn, event, 0, 0);
+        return;
+    }
+    // vsnprintf returns the untruncated length
+    uint32_t length = (uint32_t)conn->m_BufferSize < conn->m_BufferCapacity ? (uint32_t)conn->m_BufferSize : conn->m_BufferCapacity - 1;
+    PushEvent(conn, event, conn->m_Buffer, length);
+}
+
+// Exponential backoff, of which half is random, so that clients that dropped together don't all come back together
+static uint64_t GetReconnectDelay(WebsocketConnection* conn)
+{
+    uint64_t delay = g_Websocket.m_ReconnectDelay;
+    for (uint32_t i = 0; i < conn->m_ReconnectAttempts && delay < g_Websocket.m_ReconnectMaxDelay; ++i)
+        delay *= 2;
+    if (delay > g_Websocket.m_ReconnectMaxDelay)
+        delay = g_Websocket.m_ReconnectMaxDelay;
+    return delay / 2 + pcg32_random_r(&conn->m_Rnd) % (delay / 2 + 1);
+}
+
+// Tells the script side why the connection dropped, and resets the protocol state for the next attempt.
+// The network resources have been freed, and the messages sent meanwhile wait in m_Outbound
+static void ScheduleReconnect(WebsocketConnection* conn)
+{
+    PushStatus(conn, EVENT_RECONNECTING);
+
+    // The attempt failed, and the host may have moved
+    if (conn->m_Reconnecting)
+        conn->m_AddressResolved = 0;
+    conn->m_Reconnecting = 1;
+
+    conn->m_Status = RESULT_OK;
+    conn->m_BufferSize = 0;
+    FitBuffer(conn);
+    conn->m_HeaderScanned = 0;
+    conn->m_HeaderLength = 0;
+    conn->m_DeflateEnabled = 0;
+    conn->m_RecvControlFrame = 0;
+    conn->m_RecvDiscard = 0;
+    conn->m_RecvDrained = 0;
+    conn->m_RecvInMessage = 0;
+    conn->m_RecvCompressed = 0;
+    conn->m_RecvChunked = 0;
+    conn->m_Readable = 0;
+
+    conn->m_ReconnectTime = dmTime::GetTime() + GetReconnectDelay(conn);
+    ++conn->m_ReconnectAttempts;
+    ++conn->m_Stats.m_Reconnects;
+    SetState(conn, STATE_RECONNECT_WAIT);
+}
+
+// Frees the network resources of a disconnected connection, and hands it back to the script side, or
+// schedules a reconnect. Returns true once the connection has been handed back. Until then, it's called
+// again each update, until the final events fit in the queue
+static bool ReleaseConnection(WebsocketConnection* conn)
 {
+#if !defined(__EMSCRIPTEN__)
+    // The job thread uses the connection until it's done
+    if (!FinishConnectJob(conn))
+        return false;
+#endif
+
 #if defined(HAVE_WSLAY)
     if (conn->m_Ctx)
+    {
+        // The corked frames may hold the close frame
+        WSL_FlushCork(conn->m_Ctx, g_Websocket.m_Timeout);
         WSL_Exit(conn->m_Ctx);
+        conn->m_Ctx = 0;
+    }
+    // The buffers still queued in wslay are dropped with it, and the script side may release them
+    for (uint32_t i = 0; i < conn->m_QueuedSources.Size(); ++i)
+        dmAtomicStore32(&conn->m_QueuedSources[i]->m_Done, 1);
+    conn->m_QueuedSources.SetSize(0);
+    conn->m_SendSourceBytes = 0;
+    ClearLowPriority(conn);
+    free((void*)conn->m_CorkBuffer);
+    conn->m_CorkBuffer = 0;
+    conn->m_CorkSize = 0;
+    if (conn->m_RecvMessage)
+    {
+        FreeMessage(conn->m_RecvMessage);
+        conn->m_RecvMessage = 0;
+        conn->m_RecvCapacity = 0;
+    }
+    UpdateBufferedAmount(conn);
+#endif
+#if defined(HAVE_ZLIB)
+    DeflateExit(conn);
+#endif
+
+    CloseSocket(conn);
+
+    if (ShouldReconnect(conn))
+    {
+        if (FlushPending(conn->m_Inbound, conn->m_InboundPending) && conn->m_Inbound.Available() >= 1)
+            ScheduleReconnect(conn);
+        return false;
+    }
+
+    // The script side destroys the connection as soon as it sees EVENT_DISCONNECTED,
+    // so both final events have to go into the queue directly
+    if (!FlushPending(conn->m_Inbound, conn->m_InboundPending) || conn->m_Inbound.Available() < 2)
+        return false;
+
+    if (RESULT_OK != conn->m_Status)
+        PushStatus(conn, EVENT_ERROR);
+    PushEvent(conn, EVENT_DISCONNECTED, 0, 0);
+    return true;
+}
+
+// Network side: once a connection has been idle for a while, lets go of the buffers that kept the size of the
+// biggest message. They are allocated again as the traffic picks up
+static void TrimBuffers(WebsocketConnection* conn, uint64_t idle_time)
+{
+    // Only data messages count, so the pings and pongs of an otherwise idle connection don't keep the buffers.
+    // A message that is still being received keeps them too
+    uint64_t now = dmTime::GetTime();
+    uint64_t messages = conn->m_Stats.m_MessagesSent + conn->m_Stats.m_MessagesReceived;
+    if (messages != conn->m_IdleMessages || conn->m_RecvInMessage)
+    {
+        conn->m_IdleMessages = messages;
+        conn->m_IdleStart = now;
+        conn->m_BuffersTrimmed = 0;
+        return;
+    }
+    if (idle_time == 0 || conn->m_BuffersTrimmed || now - conn->m_IdleStart < idle_time)
+        return;
+
+    DM_PROFILE("WebsocketTrimBuffers");
+    conn->m_BuffersTrimmed = 1;
+    FitBuffer(conn);
+    if (conn->m_RecvMessage && !conn->m_RecvInMessage)
+    {
+        FreeMessage(conn->m_RecvMessage);
+        conn->m_RecvMessage = 0;
+        conn->m_RecvCapacity = 0;
+    }
+#if defined(HAVE_WSLAY)
+    if (conn->m_CorkSize == 0)
+    {
+        free((void*)conn->m_CorkBuffer);
+        conn->m_CorkBuffer = 0;
+    }
+    if (conn->m_Ctx)
+        wslay_event_trim_pool(conn->m_Ctx);
+#endif
+#if defined(HAVE_ZLIB)
+    DeflateTrim(conn);
+#endif
+}
+
+#if defined(HAVE_WSLAY)
+// Reads and writes what the connection has pending. Returns 0, or a wslay error
+static int PollConnection(WebsocketConnection* conn)
+{
+    // Reads until the socket is drained, so there's only more to read once the socket is readable again
+    bool recv = conn->m_Readable || !conn->m_RecvDrained;
+
+    uint64_t poll_start = dmTime::GetTime();
+    uint64_t frames = conn->m_Stats.m_FramesReceived;
+    FeedLowPriority(conn);
+    int r = WSL_Poll(conn->m_Ctx, recv);
+    // The send queue ran empty during the poll, so the next low priority message can go out in this update too,
+    // unless the time for this update is up (see websocket.max_poll_time)
+    while (0 == r && (!conn->m_RecvDeadline || dmTime::GetTime() < conn->m_RecvDeadline) && FeedLowPriority(conn))
+        r = WSL_Poll(conn->m_Ctx, false);
+    conn->m_Stats.m_PollTime += dmTime::GetTime() - poll_start;
+    if (recv)
+    {
+        ++conn->m_Stats.m_Polls;
+        conn->m_Stats.m_LastPollFrames = (uint32_t)(conn->m_Stats.m_FramesReceived - frames);
+    }
+    UpdateBufferedAmount(conn);
+    return r;
+}
+#endif
+
+static void UpdateConnection(WebsocketConnection* conn)
+{
+    if (STATE_CONNECTED == conn->m_State)
+    {
+        DM_PROFILE("WebsocketConnected");
+        TrimBuffers(conn, g_Websocket.m_BufferIdleTime);
+#if defined(HAVE_WSLAY)
+        // The status is already set
+        if (RESULT_OK != UpdateKeepalive(conn, g_Websocket.m_PingInterval, g_Websocket.m_PingTimeout))
+        {
+            CloseConnection(conn);
+            return;
+        }
+
+        int r = PollConnection(conn);
+        if (0 != r)
+        {
+            CLOSE_CONN("Websocket closing for %s (%s)", conn->m_Url.m_Hostname, WSL_ResultToString(r));
+            return;
+        }
+        r = WSL_WantsExit(conn->m_Ctx);
+        if (0 != r)
+        {
+            CLOSE_CONN("Websocket received close event for %s", conn->m_Url.m_Hostname);
+            return;
+        }
+#endif
+        // In emscripten, the browser delivers the messages as they arrive, see browser.cpp
+    }
+#if defined(HAVE_WSLAY)
+    else if (STATE_CLOSING == conn->m_State)
+    {
+        DM_PROFILE("WebsocketClosing");
+        int r = PollConnection(conn);
+
+        // wslay sends nothing after the close frame, so the low priority lane goes into its queue first
+        if (0 == r && !conn->m_CloseQueued && conn->m_LowPriorityFirst == conn->m_LowPriority.Size())
+        {
+            WSL_Close(conn->m_Ctx);
+            conn->m_CloseQueued = 1;
+            r = WSL_Poll(conn->m_Ctx, false);
+        }
+
+        // The close frame of the peer ends it, but a peer that doesn't answer only gets socket_timeout
+        if (0 != r || WSL_WantsExit(conn->m_Ctx) || dmTime::GetTime() - conn->m_StateStart > (uint64_t)g_Websocket.m_Timeout)
+            SetState(conn, STATE_DISCONNECTED);
+    }
 #endif
+#if !defined(__EMSCRIPTEN__)
+    else if (STATE_HANDSHAKE_READ == conn->m_State)
+    {
+        DM_PROFILE("WebsocketHandshakeRead");
+        Result result = ReceiveHeaders(conn);
+        if (RESULT_WOULDBLOCK == result)
+        {
+            // A client that connects, and doesn't ask for the upgrade, doesn't get to keep the connection
+            if (conn->m_Accepted && dmTime::GetTime() - conn->m_StateStart > (uint64_t)g_Websocket.m_Timeout)
+            {
+                CLOSE_CONN("No upgrade request from %s within %d ms", conn->m_Url.m_Hostname, g_Websocket.m_Timeout / 1000);
+            }
+            return;
+        }
+
+        if (RESULT_OK != result)
+        {
+            CLOSE_CONN("Failed receiving handshake headers. %d", result);
+            return;
+        }
+
+        // The status is already set
+        result = conn->m_Accepted ? AnswerClientHandshake(conn, g_Websocket.m_Timeout) : VerifyHeaders(conn);
+        if (RESULT_OK != result)
+        {
+            CloseConnection(conn);
+            return;
+        }
+
+#if defined(HAVE_WSLAY)
+        int r = WSL_Init(&conn->m_Ctx, g_Websocket.m_BufferSize, g_Websocket.m_RecvBufferSize, g_Websocket.m_SendBufferSize, (void*)conn, conn->m_Accepted);
+        if (0 != r)
+        {
+            CLOSE_CONN("Failed initializing wslay: %s", WSL_ResultToString(r));
+            return;
+        }
+
+#if defined(HAVE_ZLIB)
+        if (conn->m_DeflateEnabled)
+        {
+            if (RESULT_OK != DeflateInit(conn))
+            {
+                CloseConnection(conn);
+                return;
+            }
+            wslay_event_config_set_allowed_rsv_bits(conn->m_Ctx, WSLAY_RSV1_BIT);
+        }
+#endif
+
+        dmSocket::SetNoDelay(conn->m_Socket, true);
+        // Don't go lower than 1000 since some platforms might not have that good precision
+        dmSocket::SetReceiveTimeout(conn->m_Socket, 1000);
+        if (conn->m_SSLSocket)
+            dmSSLSocket::SetReceiveTimeout(conn->m_SSLSocket, 1000);
+#endif
+        dmSocket::SetBlocking(conn->m_Socket, false);
+
+        // Frames that arrived together with the handshake response stay in m_Buffer, and WSL_RecvCallback()
+        // hands them to wslay in the first poll, as far as each read has room
+        uint32_t leftover = (uint32_t)conn->m_BufferSize - conn->m_HeaderLength;
+        if (leftover > 0)
+        {
+            memmove(conn->m_Buffer, conn->m_Buffer + conn->m_HeaderLength, leftover);
+            conn->m_Buffer[leftover] = 0;
+        }
+        conn->m_BufferSize = leftover;
+        // The handshake data is done with
+        FitBuffer(conn);
+        conn->m_IdleStart = dmTime::GetTime();
+
+#if defined(HAVE_WSLAY)
+        StartKeepalive(conn);
+#endif
+
+        SetState(conn, STATE_CONNECTED);
+        PushEvent(conn, EVENT_CONNECTED, 0, 0);
+    }
+    else if (STATE_HANDSHAKE_WRITE == conn->m_State)
+    {
+        DM_PROFILE("WebsocketHandshakeWrite");
+        Result result = SendClientHandshake(conn, g_Websocket.m_Timeout);
+        if (RESULT_WOULDBLOCK == result)
+        {
+            return;
+        }
+        if (RESULT_OK != result)
+        {
+            CLOSE_CONN("Failed sending handshake: %d", result);
+            return;
+        }
+
+        SetState(conn, STATE_HANDSHAKE_READ);
+    }
+#endif
+    else if (STATE_RECONNECT_WAIT == conn->m_State)
+    {
+        if (dmTime::GetTime() >= conn->m_ReconnectTime)
+            SetState(conn, STATE_CONNECTING);
+    }
+    else if (STATE_CONNECTING == conn->m_State)
+    {
+        DM_PROFILE("WebsocketConnecting");
+#if defined(__EMSCRIPTEN__)
+        // The browser resolves, connects and does the handshake, and calls back once the connection is open
+        if (RESULT_OK != BrowserConnect(conn))
+        {
+            CloseConnection(conn);
+            return;
+        }
+        SetState(conn, STATE_HANDSHAKE_READ);
+#else
+        // A reconnect uses the address from the last lookup
+        if (conn->m_AddressResolved)
+        {
+            // The status is already set
+            if (RESULT_OK != StartConnect(conn))
+            {
+                CloseConnection(conn);
+                return;
+            }
+            SetState(conn, STATE_TCP_CONNECTING);
+            return;
+        }
+        StartResolve(conn);
+        SetState(conn, STATE_RESOLVING);
+#endif
+    }
+#if !defined(__EMSCRIPTEN__)
+    else if (STATE_RESOLVING == conn->m_State)
+    {
+        DM_PROFILE("WebsocketResolving");
+        Result result = PollResolve(conn);
+        if (RESULT_WOULDBLOCK == result)
+        {
+            return;
+        }
+        // The connect steps have already set the status
+        if (RESULT_OK != result || RESULT_OK != StartConnect(conn))
+        {
+            CloseConnection(conn);
+            return;
+        }
+
+        SetState(conn, STATE_TCP_CONNECTING);
+    }
+    else if (STATE_TCP_CONNECTING == conn->m_State)
+    {
+        DM_PROFILE("WebsocketTcpConnecting");
+        Result result = PollConnect(conn, g_Websocket.m_Timeout);
+        if (RESULT_WOULDBLOCK == result)
+        {
+            return;
+        }
+        if (RESULT_OK != result)
+        {
+            CloseConnection(conn);
+            return;
+        }
+
+        if (conn->m_SSL)
+        {
+            StartTlsHandshake(conn, g_Websocket.m_Timeout);
+            SetState(conn, STATE_TLS_HANDSHAKE);
+        }
+        else
+        {
+            SetState(conn, STATE_HANDSHAKE_WRITE);
+        }
+    }
+    else if (STATE_TLS_HANDSHAKE == conn->m_State)
+    {
+        DM_PROFILE("WebsocketTlsHandshake");
+        Result result = PollTlsHandshake(conn);
+        if (RESULT_WOULDBLOCK == result)
+        {
+            return;
+        }
+        if (RESULT_OK != result)
+        {
+            CloseConnection(conn);
+            return;
+        }
+
+        SetState(conn, STATE_HANDSHAKE_WRITE);
+    }
+#endif
+}
+
+#if !defined(__EMSCRIPTEN__)
+static bool WaitsForData(WebsocketConnection* conn)
+{
+    return (STATE_CONNECTED == conn->m_State || STATE_CLOSING == conn->m_State) && conn->m_RecvDrained;
+}
+
+// Finds the connected sockets with data to read, with one select per batch of sockets
+// instead of one receive call per connection. dmSocket has no epoll or kqueue
+static void PollSockets(dmArray<WebsocketConnection*>& connections)
+{
+    dmSocket::Selector selector;
+    uint32_t size = connections.Size();
+    uint32_t first = 0;
+    while (first < size)
+    {
+        dmSocket::SelectorZero(&selector);
+        uint32_t count = 0;
+        uint32_t last = first;
+        for (; last < size && count < SELECT_MAX_SOCKETS; ++last)
+        {
+            WebsocketConnection* conn = connections[last];
+            conn->m_Readable = 0;
+            if (WaitsForData(conn))
+            {
+                dmSocket::SelectorSet(&selector, dmSocket::SELECTOR_KIND_READ, conn->m_Socket);
+                ++count;
+            }
+        }
+
+        // If select fails, all sockets are read, as if they were readable
+        bool selected = count > 0 && dmSocket::RESULT_OK == dmSocket::Select(&selector, 0);
+        for (uint32_t i = first; i < last && count > 0; ++i)
+        {
+            WebsocketConnection* conn = connections[i];
+            if (WaitsForData(conn))
+                conn->m_Readable = !selected || dmSocket::SelectorIsSet(&selector, dmSocket::SELECTOR_KIND_READ, conn->m_Socket);
+        }
+        first = last;
+    }
+}
+#endif
+
+// Copies the counters, and adds the current state of the send queue
+static void GetStats(WebsocketConnection* conn, Stats* stats)
+{
+    *stats = conn->m_Stats;
+#if defined(HAVE_WSLAY)
+    if (conn->m_Ctx)
+    {
+        stats->m_QueuedMessageCount = (uint32_t)wslay_event_get_queued_msg_count(conn->m_Ctx) + conn->m_LowPriority.Size() - conn->m_LowPriorityFirst;
+        stats->m_QueuedMessageLength = GetQueuedLength(conn);
+    }
+#else
+    stats->m_QueuedMessageLength = BrowserGetBufferedAmount(conn);
+#endif
+}
+
+static void UpdateConnections(dmArray<WebsocketConnection*>& connections)
+{
+    DM_PROFILE("WebsocketUpdateConnections");
+#if !defined(__EMSCRIPTEN__)
+    PollSockets(connections);
+#endif
+
+    uint32_t size = connections.Size();
+
+    // Once the time is up, the remaining connections aren't polled until the next update, and go first then.
+    // What they already received is still handed to the script side
+    uint64_t deadline = g_Websocket.m_MaxPollTime ? dmTime::GetTime() + g_Websocket.m_MaxPollTime : 0;
+    uint32_t first = size ? g_Websocket.m_NetStart % size : 0;
+    g_Websocket.m_NetStart = first + 1;
+    bool timed_out = false;
+    for (uint32_t n = 0; n < size; ++n)
+    {
+        WebsocketConnection* conn = connections[(first + n) % size];
+
+        ProcessOutbound(conn);
+        bool flushed = FlushPending(conn->m_Inbound, conn->m_InboundPending);
+
+        if (!timed_out && deadline && dmTime::GetTime() >= deadline)
+        {
+            g_Websocket.m_NetStart = first + n;
+            timed_out = true;
+        }
+        if (timed_out)
+            continue;
+
+        // Don't produce more events until the script side has caught up
+        conn->m_RecvDeadline = deadline;
+        if (STATE_DISCONNECTED != conn->m_State && flushed)
+            UpdateConnection(conn);
+    }
+
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        WebsocketConnection* conn = connections[i];
+
+        // The connection must not be touched once it's been handed back
+        if (STATE_DISCONNECTED == conn->m_State && ReleaseConnection(conn))
+        {
+            connections.EraseSwap(i);
+            --i;
+            --size;
+        }
+    }
+}
+
+#if !defined(__EMSCRIPTEN__)
+// Network side: whether the connection has nothing to do until its socket is readable
+static bool IsIdle(WebsocketConnection* conn)
+{
+    if (!conn->m_Outbound.Empty() || !conn->m_InboundPending.Empty())
+        return false;
+    if (STATE_RECONNECT_WAIT == conn->m_State)
+        return true;
+    if (STATE_CONNECTED != conn->m_State || !conn->m_RecvDrained)
+        return false;
+#if defined(HAVE_WSLAY)
+    return GetQueuedLength(conn) == 0 && !wslay_event_want_write(conn->m_Ctx);
+#else
+    return true;
+#endif
+}
+
+// Sleeps until one of the connections has data to read, or the timeout (us) is up
+static void WaitForSockets(dmArray<WebsocketConnection*>& connections, uint32_t timeout)
+{
+    dmSocket::Selector selector;
+    dmSocket::SelectorZero(&selector);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < connections.Size() && count < SELECT_MAX_SOCKETS; ++i)
+    {
+        if (WaitsForData(connections[i]))
+        {
+            dmSocket::SelectorSet(&selector, dmSocket::SELECTOR_KIND_READ, connections[i]->m_Socket);
+            ++count;
+        }
+    }
+    if (count == 0 || dmSocket::RESULT_OK != dmSocket::Select(&selector, (int)timeout))
+        dmTime::Sleep(timeout);
+}
+#endif
+
+static void NetworkThread(void* _ctx)
+{
+    dmArray<WebsocketConnection*>& connections = g_Websocket.m_NetConnections;
+#if !defined(__EMSCRIPTEN__)
+    uint64_t busy_time = 0;
+#endif
+
+    while (dmAtomicGet32(&g_Websocket.m_ThreadRunning))
+    {
+        {
+            DM_MUTEX_SCOPED_LOCK(g_Websocket.m_Mutex);
+
+            // Without connections, there's nothing to do until one is started
+            while (connections.Empty() && g_Websocket.m_NewConnections.Empty() && dmAtomicGet32(&g_Websocket.m_ThreadRunning))
+                dmConditionVariable::Wait(g_Websocket.m_Wake, g_Websocket.m_Mutex);
+
+            uint32_t num_new = g_Websocket.m_NewConnections.Size();
+            if (num_new > connections.Remaining())
+                connections.OffsetCapacity(num_new - connections.Remaining() + 2);
+            for (uint32_t i = 0; i < num_new; ++i)
+                connections.Push(g_Websocket.m_NewConnections[i]);
+            g_Websocket.m_NewConnections.SetSize(0);
+        }
+
+        UpdateConnections(connections);
+
+        {
+            DM_MUTEX_SCOPED_LOCK(g_Websocket.m_Mutex);
+            for (uint32_t i = 0; i < connections.Size(); ++i)
+                GetStats(connections[i], &connections[i]->m_PublishedStats);
+        }
+
+#if !defined(__EMSCRIPTEN__)
+        // Waking up every millisecond costs battery, so connections that have been quiet for a while
+        // are only looked at again when data arrives, or after a longer wait
+        uint64_t now = dmTime::GetTime();
+        for (uint32_t i = 0; i < connections.Size(); ++i)
+        {
+            if (!IsIdle(connections[i]))
+            {
+                busy_time = now;
+                break;
+            }
+        }
+        if (now - busy_time >= NETWORK_THREAD_IDLE_DELAY)
+        {
+            WaitForSockets(connections, NETWORK_THREAD_IDLE_WAIT);
+            continue;
+        }
+#endif
+        dmTime::Sleep(NETWORK_THREAD_SLEEP);
+    }
+}
+
+// ***************************************************************************************************
+// LUA functions
+
+
+
+static WebsocketConnection* NewConnection(State state)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)malloc(sizeof(WebsocketConnection));
+    memset(conn, 0, sizeof(WebsocketConnection));
+    // The buffer is allocated once it's needed, see GrowBuffer()
+    conn->m_MaxMessageSize = (uint32_t)g_Websocket.m_BufferSize;
+
+    conn->m_State = state;
+    conn->m_StateStart = dmTime::GetTime();
+    conn->m_Socket = dmSocket::INVALID_SOCKET_HANDLE;
+    conn->m_SSLSocket = dmSSLSocket::INVALID_SOCKET_HANDLE;
+    pcg32_srandom_entropy_r(&conn->m_Rnd);
+
+    conn->m_Inbound.SetCapacity(MESSAGE_QUEUE_SIZE);
+    if (g_Websocket.m_Threaded)
+        conn->m_Outbound.SetCapacity(MESSAGE_QUEUE_SIZE);
+
+    return conn;
+}
+
+static WebsocketConnection* CreateConnection(const char* url)
+{
+    WebsocketConnection* conn = NewConnection(STATE_CONNECTING);
+
+    dmURI::Parse(url, &conn->m_Url);
+
+    if (strcmp(conn->m_Url.m_Scheme, "https") == 0)
+        strcpy(conn->m_Url.m_Scheme, "wss");
+
+    conn->m_SSL = strcmp(conn->m_Url.m_Scheme, "wss") == 0 ? 1 : 0;
+    return conn;
+}
+
+// The connection starts out waiting for the upgrade request of the client
+static WebsocketConnection* CreateAcceptedConnection(WebsocketServer* server, dmSocket::Socket socket)
+{
+    WebsocketConnection* conn = NewConnection(STATE_HANDSHAKE_READ);
+    conn->m_Accepted = 1;
+    conn->m_Socket = socket;
+    dmSocket::SetBlocking(socket, true);
+    // Bounds each blocking write of the handshake, see SendAll()
+    dmSocket::SetSendTimeout(socket, g_Websocket.m_Timeout);
+
+    // Names the connection in the error messages
+    dmSnPrintf(conn->m_Url.m_Hostname, sizeof(conn->m_Url.m_Hostname), "client on port %d", (int)server->m_Port);
+    conn->m_Url.m_Port = server->m_Port;
+
+    conn->m_BatchMessages = server->m_BatchMessages;
+    conn->m_MessageBuffers = server->m_MessageBuffers;
+    conn->m_PositionalCallback = server->m_PositionalCallback;
+    conn->m_Cork = server->m_Cork;
+    conn->m_DataType = server->m_DataType;
+    conn->m_ChunkSize = server->m_ChunkSize;
+    conn->m_Protocol = server->m_Protocol ? strdup(server->m_Protocol) : 0;
+
+    conn->m_Server = server;
+    conn->m_Callback = server->m_Callback;
+    ++server->m_RefCount;
+    return conn;
+}
+
+// The server goes away once it's been closed, and all of its connections are destroyed
+static void ReleaseServer(WebsocketServer* server)
+{
+    if (--server->m_RefCount != 0)
+        return;
+    dmScript::DestroyCallback(server->m_Callback);
+    free((void*)server->m_Protocol);
+    free((void*)server);
+}
+
+// Lets go of the buffers the network side is done with. The network side must have released
+// the connection (see ReleaseConnection) before all buffers can be released
+static void ReleaseSendSources(WebsocketConnection* conn, bool all)
+{
+    if (conn->m_SendSources.Empty())
+        return;
+
+    lua_State* L = dmScript::GetCallbackLuaContext(conn->m_Callback);
+    for (uint32_t i = 0; i < conn->m_SendSources.Size(); ++i)
+    {
+        SendSource* source = conn->m_SendSources[i];
+        if (!all && !dmAtomicGet32(&source->m_Done))
+            continue;
+        if (!source->m_Shared)
+            dmScript::Unref(L, LUA_REGISTRYINDEX, source->m_Ref);
+        else if (--source->m_Shared->m_RefCount == 0)
+        {
+            dmScript::Unref(L, LUA_REGISTRYINDEX, source->m_Shared->m_Ref);
+            free((void*)source->m_Shared);
+        }
+        free((void*)source);
+        conn->m_SendSources.EraseSwap(i--);
+    }
+}
+
+static void ReleaseMessageBuffer(lua_State* L, MessageBuffer* buffer)
+{
+    // The script may still hold the userdata, and gets an invalid buffer
+    dmScript::Unref(L, LUA_REGISTRYINDEX, buffer->m_Ref);
+    dmBuffer::Destroy(buffer->m_Buffer);
+}
+
+// The network side must have released the connection (see ReleaseConnection)
+static void DestroyConnection(WebsocketConnection* conn)
+{
+    ReleaseSendSources(conn, true);
+    conn->m_SendSources.SetCapacity(0);
+    if (!conn->m_MessageBufferPool.Empty())
+    {
+        lua_State* L = dmScript::GetCallbackLuaContext(conn->m_Callback);
+        for (uint32_t i = 0; i < conn->m_MessageBufferPool.Size(); ++i)
+            ReleaseMessageBuffer(L, &conn->m_MessageBufferPool[i]);
+        conn->m_MessageBufferPool.SetCapacity(0);
+    }
+    conn->m_QueuedSources.SetCapacity(0);
+    conn->m_LowPriority.SetCapacity(0);
+
+    if (conn->m_Server)
+        ReleaseServer(conn->m_Server);
+    else if (conn->m_Callback)
+        dmScript::DestroyCallback(conn->m_Callback);
+
+    for (uint32_t i = 0; i < conn->m_Messages.Size(); ++i)
+        FreeMessage(conn->m_Messages[i]);
+    conn->m_Messages.SetCapacity(0);
+
+    FreeMessages(conn->m_Inbound, conn->m_InboundPending);
+    FreeMessages(conn->m_Outbound, conn->m_OutboundPending);
+
+    free((void*)conn->m_Protocol);
+    free((void*)conn->m_CustomHeaders);
+    free((void*)conn->m_Buffer);
+    free((void*)conn);
+}
+
+// Gives the network side ownership of the socket and protocol state of the connection
+static void StartConnection(WebsocketConnection* conn)
+{
+    dmArray<WebsocketConnection*>* connections = &g_Websocket.m_NetConnections;
+    if (g_Websocket.m_Threaded)
+    {
+        dmMutex::Lock(g_Websocket.m_Mutex);
+        connections = &g_Websocket.m_NewConnections;
+    }
+
+    if (connections->Full())
+        connections->OffsetCapacity(2);
+    connections->Push(conn);
+
+    if (g_Websocket.m_Threaded)
+    {
+        dmConditionVariable::Signal(g_Websocket.m_Wake);
+        dmMutex::Unlock(g_Websocket.m_Mutex);
+    }
+}
+
+// Returns 0 if there are no free slots
+static uint32_t AllocateSlot(WebsocketConnection* conn, WebsocketServer* server)
+{
+    uint32_t index;
+    if (!g_Websocket.m_FreeSlots.Empty())
+    {
+        index = g_Websocket.m_FreeSlots.Back();
+        g_Websocket.m_FreeSlots.Pop();
+    }
+    else
+    {
+        index = g_Websocket.m_Slots.Size();
+        if (index > HANDLE_INDEX_MASK)
+            return 0;
+        if (g_Websocket.m_Slots.Full())
+            g_Websocket.m_Slots.OffsetCapacity(4);
+        HandleSlot slot = {0, 0, 1};
+        g_Websocket.m_Slots.Push(slot);
+    }
+
+    HandleSlot& slot = g_Websocket.m_Slots[index];
+    slot.m_Connection = conn;
+    slot.m_Server = server;
+    return ((uint32_t)slot.m_Generation << HANDLE_INDEX_BITS) | index;
+}
+
+static void FreeSlot(uint32_t handle)
+{
+    uint32_t index = handle & HANDLE_INDEX_MASK;
+    HandleSlot& slot = g_Websocket.m_Slots[index];
+    slot.m_Connection = 0;
+    slot.m_Server = 0;
+    if (++slot.m_Generation == 0)
+        slot.m_Generation = 1;
+
+    if (g_Websocket.m_FreeSlots.Full())
+        g_Websocket.m_FreeSlots.OffsetCapacity(4);
+    g_Websocket.m_FreeSlots.Push((uint16_t)index);
+}
+
+// Returns 0 if the handle doesn't belong to a live slot
+static const HandleSlot* FindSlot(void* handle)
+{
+    uintptr_t h = (uintptr_t)handle;
+    uint32_t index = (uint32_t)(h & HANDLE_INDEX_MASK);
+    if (index >= g_Websocket.m_Slots.Size())
+        return 0;
+
+    const HandleSlot& slot = g_Websocket.m_Slots[index];
+    if ((uintptr_t)slot.m_Generation != (h >> HANDLE_INDEX_BITS))
+        return 0;
+    return &slot;
+}
+
+// Returns false if there are no free slots
+static bool AllocateHandle(WebsocketConnection* conn)
+{
+    conn->m_Handle = AllocateSlot(conn, 0);
+    return conn->m_Handle != 0;
+}
+
+static void FreeHandle(WebsocketConnection* conn)
+{
+    FreeSlot(conn->m_Handle);
+}
+
+// Returns 0 if the handle doesn't belong to a live connection
+static WebsocketConnection* FindConnection(void* handle)
+{
+    const HandleSlot* slot = FindSlot(handle);
+    return slot ? slot->m_Connection : 0;
+}
+
+static void PushHandle(lua_State* L, WebsocketConnection* conn)
+{
+    lua_pushlightuserdata(L, (void*)(uintptr_t)conn->m_Handle);
+}
+
+/*#
+*
+*/
+static int LuaConnect(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    if (!g_Websocket.m_Initialized)
+        return DM_LUA_ERROR("The web socket module isn't initialized");
+
+    const char* url = luaL_checkstring(L, 1);
+
+    bool batch_messages = luaL_checktable_bool(L, 2, "batch_messages", false);
+    bool message_buffers = luaL_checktable_bool(L, 2, "message_buffer", false);
+    bool positional_callback = luaL_checktable_bool(L, 2, "positional_callback", false);
+    bool cork = luaL_checktable_bool(L, 2, "cork", false);
+    const char* protocol = luaL_checktable_string(L, 2, "protocol", 0);
+    const char* headers = luaL_checktable_string(L, 2, "headers", 0);
+    bool deflate = luaL_checktable_bool(L, 2, "deflate", false);
+    int deflate_window_bits = (int)luaL_checktable_number(L, 2, "deflate_window_bits", 15);
+    bool deflate_no_context_takeover = luaL_checktable_bool(L, 2, "deflate_no_context_takeover", false);
+    int deflate_min_size = (int)luaL_checktable_number(L, 2, "deflate_min_size", 64);
+    int data_type = (int)luaL_checktable_number(L, 2, "data_type", DATA_TYPE_BINARY);
+    int chunk_size = (int)luaL_checktable_number(L, 2, "chunk_size", 0);
+    bool reconnect = luaL_checktable_bool(L, 2, "reconnect", false);
+    int reconnect_attempts = (int)luaL_checktable_number(L, 2, "reconnect_attempts", 0);
+
+    if (data_type != DATA_TYPE_BINARY && data_type != DATA_TYPE_TEXT)
+        return DM_LUA_ERROR("data_type must be websocket.DATA_TYPE_BINARY or websocket.DATA_TYPE_TEXT");
+
+    if (deflate_window_bits < 9 || deflate_window_bits > 15)
+        return DM_LUA_ERROR("deflate_window_bits must be between 9 and 15");
+
+#if defined(__EMSCRIPTEN__)
+    // The browser negotiates compression itself
+    deflate = false;
+#elif !defined(HAVE_ZLIB)
+    if (deflate)
+        return DM_LUA_ERROR("deflate isn't available on this platform, the extension is built without zlib");
+#endif
+
+    if (g_Websocket.m_MaxConnections)
+    {
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < g_Websocket.m_Connections.Size(); ++i)
+            count += g_Websocket.m_Connections[i]->m_Accepted ? 0 : 1;
+        if (count >= g_Websocket.m_MaxConnections)
+            return DM_LUA_ERROR("Too many connections, websocket.max_connections is %u", g_Websocket.m_MaxConnections);
+    }
+
+    WebsocketConnection* conn = CreateConnection(url);
+    if (!AllocateHandle(conn))
+    {
+        DestroyConnection(conn);
+        return DM_LUA_ERROR("Too many connections");
+    }
+    conn->m_BatchMessages = batch_messages ? 1 : 0;
+    conn->m_MessageBuffers = message_buffers ? 1 : 0;
+    conn->m_PositionalCallback = positional_callback ? 1 : 0;
+    conn->m_Cork = cork ? 1 : 0;
+    conn->m_DataType = (DataType)data_type;
+    conn->m_ChunkSize = chunk_size > 0 ? (uint32_t)chunk_size : 0;
+    conn->m_Protocol = protocol ? strdup(protocol) : 0;
+    conn->m_CustomHeaders = headers ? strdup(headers) : 0;
+    conn->m_DeflateRequested = deflate ? 1 : 0;
+    conn->m_DeflateWindowBits = (uint8_t)deflate_window_bits;
+    conn->m_DeflateNoContextTakeover = deflate_no_context_takeover ? 1 : 0;
+    conn->m_DeflateMinSize = deflate_min_size > 0 ? (uint32_t)deflate_min_size : 0;
+    conn->m_Reconnect = reconnect ? 1 : 0;
+    conn->m_MaxReconnectAttempts = reconnect_attempts > 0 ? (uint32_t)reconnect_attempts : 0;
+    // The sends go through the queue, so they can wait out an outage
+    if (reconnect && !g_Websocket.m_Threaded)
+        conn->m_Outbound.SetCapacity(MESSAGE_QUEUE_SIZE);
+
+    conn->m_Callback = dmScript::CreateCallback(L, 3);
+
+    if (g_Websocket.m_Connections.Full())
+        g_Websocket.m_Connections.OffsetCapacity(2);
+    g_Websocket.m_Connections.Push(conn);
+
+    StartConnection(conn);
+
+    PushHandle(L, conn);
+    return 1;
+}
+
+static int LuaDisconnect(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    if (!g_Websocket.m_Initialized)
+        return DM_LUA_ERROR("The web socket module isn't initialized");
+
+    if (!lua_islightuserdata(L, 1))
+        return DM_LUA_ERROR("The first argument must be a valid connection!");
+
+    WebsocketConnection* conn = FindConnection(lua_touserdata(L, 1));
+    if (conn && !conn->m_ScriptClosed)
+    {
+        conn->m_ScriptClosed = 1;
+        // Also keeps a connection that dropped from reconnecting
+        dmAtomicStore32(&conn->m_CloseRequested, 1);
+        if (!g_Websocket.m_Threaded)
+        {
+            // The messages that are still queued go out first, as in threaded mode
+            ProcessOutbound(conn);
+            StartClosing(conn);
+        }
+        else
+            PushOrDefer(conn->m_Outbound, conn->m_OutboundPending, NewMessage(EVENT_DISCONNECTED, 0, 0));
+    }
+    return 0;
+}
+
+// Sends go through m_Outbound in threaded mode, and on connections that reconnect
+static bool UsesOutbound(WebsocketConnection* conn)
+{
+    return g_Websocket.m_Threaded || conn->m_Reconnect;
+}
+
+// Sends a copy of the data. The browser has a single send queue, so the priority only matters with wslay
+static void SendCopy(WebsocketConnection* conn, const char* data, uint32_t length, DataType type, Priority priority)
+{
+    uint32_t event = DATA_TYPE_TEXT == type ? OUTBOUND_TEXT_MESSAGE : EVENT_MESSAGE;
+    if (UsesOutbound(conn))
+    {
+        if (PRIORITY_LOW == priority)
+            event |= OUTBOUND_LOW_PRIORITY;
+        dmAtomicAdd32(&conn->m_OutboundBytes, (int32_t)length);
+        PushOrDefer(conn->m_Outbound, conn->m_OutboundPending, NewMessage(event, data, length));
+    }
+#if defined(HAVE_WSLAY)
+    else if (PRIORITY_LOW == priority)
+        QueueLowPriority(conn, NewMessage(event, data, length));
+#endif
+    else
+        QueueMessage(conn, data, length, type);
+}
+
+#if defined(HAVE_WSLAY)
+static SendSource* NewSendSource(const void* data, uint32_t size, DataType type)
+{
+    SendSource* source = (SendSource*)malloc(sizeof(SendSource));
+    source->m_Data = (const uint8_t*)data;
+    source->m_Size = size;
+    source->m_Offset = 0;
+    source->m_DataType = type;
+    source->m_Ref = LUA_NOREF;
+    source->m_Shared = 0;
+    dmAtomicStore32(&source->m_Done, 0);
+    return source;
+}
+
+// Hands the source to the network side, and keeps it until the network side is done with it
+static void PostSendSource(WebsocketConnection* conn, SendSource* source, Priority priority)
+{
+    if (conn->m_SendSources.Full())
+        conn->m_SendSources.OffsetCapacity(4);
+    conn->m_SendSources.Push(source);
+
+    uint32_t event = OUTBOUND_SEND_SOURCE | (PRIORITY_LOW == priority ? OUTBOUND_LOW_PRIORITY : 0);
+    if (UsesOutbound(conn))
+    {
+        dmAtomicAdd32(&conn->m_OutboundBytes, (int32_t)source->m_Size);
+        PushOrDefer(conn->m_Outbound, conn->m_OutboundPending, NewMessage(event, &source, sizeof(source)));
+    }
+    else if (PRIORITY_LOW == priority)
+        QueueLowPriority(conn, NewMessage(OUTBOUND_SEND_SOURCE, &source, sizeof(source)));
+    else
+        QueueSendSource(conn, source);
+}
+#endif
+
+static bool CanSend(WebsocketConnection* conn)
+{
+    return UsesOutbound(conn) ? (conn->m_ScriptConnected && !conn->m_ScriptClosed) : conn->m_State == STATE_CONNECTED;
+}
+
+// Whether the buffer is one of the received message buffers, which are overwritten by a later message
+// and may be destroyed with their connection, see TakeMessageBuffer()
+static bool IsMessageBuffer(dmBuffer::HBuffer buffer)
+{
+    for (uint32_t i = 0; i < g_Websocket.m_Connections.Size(); ++i)
+    {
+        const dmArray<MessageBuffer>& pool = g_Websocket.m_Connections[i]->m_MessageBufferPool;
+        for (uint32_t j = 0; j < pool.Size(); ++j)
+        {
+            if (pool[j].m_Buffer == buffer)
+                return true;
+        }
+    }
+    return false;
+}
+
+static int LuaSend(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    if (!g_Websocket.m_Initialized)
+        return DM_LUA_ERROR("The web socket module isn't initialized");
+
+    if (!lua_islightuserdata(L, 1))
+        return DM_LUA_ERROR("The first argument must be a valid connection!");
+
+    WebsocketConnection* conn = FindConnection(lua_touserdata(L, 1));
+    if (!conn)
+        return DM_LUA_ERROR("Invalid connection");
+
+    if (!CanSend(conn))
+        return DM_LUA_ERROR("Connection isn't connected");
+
+    int data_type = (int)luaL_checktable_number(L, 3, "type", conn->m_DataType);
+    if (data_type != DATA_TYPE_BINARY && data_type != DATA_TYPE_TEXT)
+        return DM_LUA_ERROR("type must be websocket.DATA_TYPE_BINARY or websocket.DATA_TYPE_TEXT");
+    DataType type = (DataType)data_type;
+
+    int priority = (int)luaL_checktable_number(L, 3, "priority", PRIORITY_HIGH);
+    if (priority != PRIORITY_HIGH && priority != PRIORITY_LOW)
+        return DM_LUA_ERROR("priority must be websocket.PRIORITY_HIGH or websocket.PRIORITY_LOW");
+
+    if (dmScript::IsBuffer(L, 2))
+    {
+        dmBuffer::HBuffer buffer = dmScript::CheckBufferUnpack(L, 2);
+        void* bytes = 0;
+        uint32_t size = 0;
+        if (dmBuffer::RESULT_OK != dmBuffer::GetBytes(buffer, &bytes, &size))
+            return DM_LUA_ERROR("Invalid buffer");
+
+#if defined(HAVE_WSLAY)
+        if (!IsMessageBuffer(buffer))
+        {
+            SendSource* source = NewSendSource(bytes, size, type);
+            lua_pushvalue(L, 2);
+            source->m_Ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+            PostSendSource(conn, source, (Priority)priority);
+            return 0;
+        }
+#endif
+        SendCopy(conn, (const char*)bytes, size, type, (Priority)priority);
+        return 0;
+    }
+
+    size_t string_length = 0;
+    const char* string = luaL_checklstring(L, 2, &string_length);
+    SendCopy(conn, string, (uint32_t)string_length, type, (Priority)priority);
+    return 0;
+}
+
+// Returns the connection at a position of the table at index 1, or 0
+static WebsocketConnection* GetConnectionAt(lua_State* L, uint32_t i)
+{
+    lua_rawgeti(L, 1, (int)i);
+    WebsocketConnection* conn = lua_islightuserdata(L, -1) ? FindConnection(lua_touserdata(L, -1)) : 0;
+    lua_pop(L, 1);
+    return conn;
+}
+
+// Sends one message on several connections. The payload isn't copied: each connection reads its frames
+// straight from the Lua string or buffer, which is kept alive until the last of them is done with it
+static int LuaSendMany(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    if (!g_Websocket.m_Initialized)
+        return DM_LUA_ERROR("The web socket module isn't initialized");
+
+    if (!lua_istable(L, 1))
+        return DM_LUA_ERROR("The first argument must be a table of connections!");
+
+    int data_type = (int)luaL_checktable_number(L, 3, "type", -1);
+    if (data_type != -1 && data_type != DATA_TYPE_BINARY && data_type != DATA_TYPE_TEXT)
+        return DM_LUA_ERROR("type must be websocket.DATA_TYPE_BINARY or websocket.DATA_TYPE_TEXT");
+
+    int priority = (int)luaL_checktable_number(L, 3, "priority", PRIORITY_HIGH);
+    if (priority != PRIORITY_HIGH && priority != PRIORITY_LOW)
+        return DM_LUA_ERROR("priority must be websocket.PRIORITY_HIGH or websocket.PRIORITY_LOW");
+
+    const char* data = 0;
+    uint32_t size = 0;
+    if (dmScript::IsBuffer(L, 2))
+    {
+        dmBuffer::HBuffer buffer = dmScript::CheckBufferUnpack(L, 2);
+        void* bytes = 0;
+        if (dmBuffer::RESULT_OK != dmBuffer::GetBytes(buffer, &bytes, &size))
+            return DM_LUA_ERROR("Invalid buffer");
+        data = (const char*)bytes;
+
+        // A received message buffer is reused, so the connections read from a single copy of it
+        if (IsMessageBuffer(buffer))
+        {
+            lua_pushlstring(L, data, size);
+            lua_replace(L, 2);
+            data = lua_tostring(L, 2);
+        }
+    }
+    else
+    {
+        size_t string_length = 0;
+        data = luaL_checklstring(L, 2, &string_length);
+        size = (uint32_t)string_length;
+    }
+
+    // The message goes out on all of the connections, or on none
+    uint32_t count = (uint32_t)lua_objlen(L, 1);
+    for (uint32_t i = 1; i <= count; ++i)
+    {
+        WebsocketConnection* conn = GetConnectionAt(L, i);
+        if (!conn)
+            return DM_LUA_ERROR("Invalid connection at index %u", i);
+        if (!CanSend(conn))
+            return DM_LUA_ERROR("Connection at index %u isn't connected", i);
+    }
+    if (count == 0)
+        return 0;
+
+#if defined(HAVE_WSLAY)
+    SharedPayload* shared = (SharedPayload*)malloc(sizeof(SharedPayload));
+    lua_pushvalue(L, 2);
+    shared->m_Ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+    shared->m_RefCount = count;
+#endif
+
+    for (uint32_t i = 1; i <= count; ++i)
+    {
+        WebsocketConnection* conn = GetConnectionAt(L, i);
+        DataType type = data_type < 0 ? conn->m_DataType : (DataType)data_type;
+#if defined(HAVE_WSLAY)
+        SendSource* source = NewSendSource(data, size, type);
+        source->m_Shared = shared;
+        PostSendSource(conn, source, (Priority)priority);
+#else
+        // The browser copies each message anyway
+        SendCopy(conn, data, size, type, (Priority)priority);
+#endif
+    }
+    return 0;
+}
+
+// The number of bytes that have been sent with websocket.send(), but not yet written to the socket
+static uint32_t GetBufferedAmount(WebsocketConnection* conn)
+{
+    // Still in m_Outbound
+    uint32_t outbound = (uint32_t)dmAtomicGet32(&conn->m_OutboundBytes);
+    if (g_Websocket.m_Threaded)
+        return outbound + (uint32_t)dmAtomicGet32(&conn->m_BufferedAmount);
+
+#if defined(HAVE_WSLAY)
+    return outbound + GetQueuedLength(conn);
+#else
+    return outbound + BrowserGetBufferedAmount(conn);
+#endif
+}
+
+static int LuaGetBufferedAmount(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    if (!g_Websocket.m_Initialized)
+        return DM_LUA_ERROR("The web socket module isn't initialized");
+
+    if (!lua_islightuserdata(L, 1))
+        return DM_LUA_ERROR("The first argument must be a valid connection!");
+
+    WebsocketConnection* conn = FindConnection(lua_touserdata(L, 1));
+    if (!conn)
+        return DM_LUA_ERROR("Invalid connection");
+
+    lua_pushinteger(L, GetBufferedAmount(conn));
+    return 1;
+}
+
+static void SetStatsField(lua_State* L, const char* name, uint64_t value)
+{
+    lua_pushnumber(L, (lua_Number)value);
+    lua_setfield(L, -2, name);
+}
+
+static void SetStatsTime(lua_State* L, const char* name, uint64_t us)
+{
+    lua_pushnumber(L, us / 1000000.0);
+    lua_setfield(L, -2, name);
+}
+
+static int LuaGetStats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    if (!g_Websocket.m_Initialized)
+        return DM_LUA_ERROR("The web socket module isn't initialized");
 
-    if (conn->m_Callback)
-        dmScript::DestroyCallback(conn->m_Callback);
+    if (!lua_islightuserdata(L, 1))
+        return DM_LUA_ERROR("The first argument must be a valid connection!");
 
-#if defined(__EMSCRIPTEN__)
-    if (conn->m_Socket != dmSocket::INVALID_SOCKET_HANDLE) {
-        // We would normally do a shutdown() first, but Emscripten returns ENOSYS
-        //dmSocket::Shutdown(conn->m_Socket, dmSocket::SHUTDOWNTYPE_READWRITE);
-        dmSocket::Delete(conn->m_Socket);
+    WebsocketConnection* conn = FindConnection(lua_touserdata(L, 1));
+    if (!conn)
+        return DM_LUA_ERROR("Invalid connection");
+
+    Stats stats;
+    if (g_Websocket.m_Threaded)
+    {
+        DM_MUTEX_SCOPED_LOCK(g_Websocket.m_Mutex);
+        stats = conn->m_PublishedStats;
     }
-#else
-    if (conn->m_Connection)
-        dmConnectionPool::Return(g_Websocket.m_Pool, conn->m_Connection);
-#endif
+    else
+        GetStats(conn, &stats);
 
-    free((void*)conn->m_Buffer);
-    free((void*)conn);
+    lua_newtable(L);
+    SetStatsField(L, "bytes_sent", stats.m_BytesSent);
+    SetStatsField(L, "bytes_received", stats.m_BytesReceived);
+    SetStatsField(L, "messages_sent", stats.m_MessagesSent);
+    SetStatsField(L, "messages_received", stats.m_MessagesReceived);
+    SetStatsField(L, "frames_received", stats.m_FramesReceived);
+    SetStatsField(L, "polls", stats.m_Polls);
+    SetStatsField(L, "last_poll_frames", stats.m_LastPollFrames);
+    SetStatsField(L, "queued_message_count", stats.m_QueuedMessageCount);
+    SetStatsField(L, "queued_message_length", stats.m_QueuedMessageLength);
+    SetStatsTime(L, "connect_time", stats.m_ConnectTime);
+    SetStatsTime(L, "tls_time", stats.m_TlsTime);
+    SetStatsTime(L, "http_time", stats.m_HttpTime);
+    SetStatsTime(L, "poll_time", stats.m_PollTime);
+    SetStatsField(L, "pongs", stats.m_Pongs);
+    SetStatsField(L, "reconnects", stats.m_Reconnects);
+    SetStatsTime(L, "last_rtt", stats.m_LastRtt);
+    SetStatsTime(L, "rtt", stats.m_Rtt);
+    SetStatsTime(L, "rtt_jitter", stats.m_RttJitter);
+    return 1;
 }
 
-
-static void CloseConnection(WebsocketConnection* conn)
+// Returns 0 if the handle doesn't belong to a server that's listening
+static WebsocketServer* FindServer(void* handle)
 {
-    State prev_state = conn->m_State;
+    const HandleSlot* slot = FindSlot(handle);
+    return slot ? slot->m_Server : 0;
+}
 
-    // we want it to send this message in the polling
-    if (conn->m_State == STATE_CONNECTED) {
-#if defined(HAVE_WSLAY)
-        WSL_Close(conn->m_Ctx);
-#endif
+// Stops listening. The accepted connections stay open
+static void CloseServer(WebsocketServer* server)
+{
+    for (uint32_t i = 0; i < g_Websocket.m_Servers.Size(); ++i)
+    {
+        if (g_Websocket.m_Servers[i] == server)
+        {
+            g_Websocket.m_Servers.EraseSwap(i);
+            break;
+        }
     }
-
-    SetState(conn, STATE_DISCONNECTED);
+    // The accepted connections may keep the server alive, but the handle is stale from now on
+    FreeSlot(server->m_Handle);
+    server->m_Handle = 0;
+    dmSocket::Delete(server->m_Socket);
+    server->m_Socket = dmSocket::INVALID_SOCKET_HANDLE;
+    ReleaseServer(server);
 }
 
-static int FindConnection(WebsocketConnection* conn)
+// Takes the clients waiting on the listening sockets, without blocking.
+// The accepted connections do their handshake on the network side, as the other connections
+static void AcceptConnections()
 {
-    for (int i = 0; i < g_Websocket.m_Connections.Size(); ++i )
+    for (uint32_t i = 0; i < g_Websocket.m_Servers.Size(); ++i)
     {
-        if (g_Websocket.m_Connections[i] == conn)
-            return i;
+        WebsocketServer* server = g_Websocket.m_Servers[i];
+        for (uint32_t n = 0; n < MAX_ACCEPTS_PER_UPDATE; ++n)
+        {
+            dmSocket::Address address;
+            dmSocket::Socket socket;
+            if (dmSocket::RESULT_OK != dmSocket::Accept(server->m_Socket, &address, &socket))
+                break;
+
+            WebsocketConnection* conn = CreateAcceptedConnection(server, socket);
+            if (!AllocateHandle(conn))
+            {
+                dmLogWarning("Too many connections, refusing a client on port %d", (int)server->m_Port);
+                CloseSocket(conn);
+                DestroyConnection(conn);
+                continue;
+            }
+
+            if (g_Websocket.m_Connections.Full())
+                g_Websocket.m_Connections.OffsetCapacity(2);
+            g_Websocket.m_Connections.Push(conn);
+
+            StartConnection(conn);
+        }
     }
-    return -1;
 }
 
-/*#
-*
-*/
-static int LuaConnect(lua_State* L)
+static int LuaListen(lua_State* L)
 {
     DM_LUA_STACK_CHECK(L, 1);
 
     if (!g_Websocket.m_Initialized)
         return DM_LUA_ERROR("The web socket module isn't initialized");
 
-    const char* url = luaL_checkstring(L, 1);
-
-    // long playedTime = luaL_checktable_number(L, 2, "playedTime", -1);
-    // long progressValue = luaL_checktable_number(L, 2, "progressValue", -1);
-    // char *description = luaL_checktable_string(L, 2, "description", NULL);
-    // char *coverImage = luaL_checktable_string(L, 2, "coverImage", NULL);
-
-    WebsocketConnection* conn = CreateConnection(url);
-
-    conn->m_Callback = dmScript::CreateCallback(L, 3);
-
-    if (g_Websocket.m_Connections.Full())
-        g_Websocket.m_Connections.OffsetCapacity(2);
-    g_Websocket.m_Connections.Push(conn);
+#if defined(__EMSCRIPTEN__)
+    return DM_LUA_ERROR("Listening isn't supported on HTML5");
+#else
+    int port = luaL_checkinteger(L, 1);
+    if (port <= 0 || port > 65535)
+        return DM_LUA_ERROR("port must be between 1 and 65535");
+
+    // The parameters are optional
+    int callback_index = lua_isfunction(L, 2) ? 2 : 3;
+    const char* host = luaL_checktable_string(L, 2, "host", 0);
+    const char* protocol = luaL_checktable_string(L, 2, "protocol", 0);
+    bool batch_messages = luaL_checktable_bool(L, 2, "batch_messages", false);
+    bool message_buffers = luaL_checktable_bool(L, 2, "message_buffer", false);
+    bool positional_callback = luaL_checktable_bool(L, 2, "positional_callback", false);
+    bool cork = luaL_checktable_bool(L, 2, "cork", false);
+    int data_type = (int)luaL_checktable_number(L, 2, "data_type", DATA_TYPE_BINARY);
+    int chunk_size = (int)luaL_checktable_number(L, 2, "chunk_size", 0);
+
+    if (data_type != DATA_TYPE_BINARY && data_type != DATA_TYPE_TEXT)
+        return DM_LUA_ERROR("data_type must be websocket.DATA_TYPE_BINARY or websocket.DATA_TYPE_TEXT");
+    luaL_checktype(L, callback_index, LUA_TFUNCTION);
+
+    if (!host)
+        host = "0.0.0.0";
+    dmSocket::Socket socket;
+    dmSocket::Result sr = OpenListenSocket(host, (uint16_t)port, &socket);
+    if (dmSocket::RESULT_OK != sr)
+        return DM_LUA_ERROR("Failed to listen on %s:%d: %s", host, port, dmSocket::ResultToString(sr));
 
-    lua_pushlightuserdata(L, conn);
+    WebsocketServer* server = (WebsocketServer*)malloc(sizeof(WebsocketServer));
+    memset(server, 0, sizeof(WebsocketServer));
+    server->m_Handle = AllocateSlot(0, server);
+    if (!server->m_Handle)
+    {
+        free((void*)server);
+        dmSocket::Delete(socket);
+        return DM_LUA_ERROR("Too many connections and servers");
+    }
+    server->m_Socket = socket;
+    server->m_Port = (uint16_t)port;
+    server->m_RefCount = 1;
+    server->m_Protocol = protocol ? strdup(protocol) : 0;
+    server->m_BatchMessages = batch_messages ? 1 : 0;
+    server->m_MessageBuffers = message_buffers ? 1 : 0;
+    server->m_PositionalCallback = positional_callback ? 1 : 0;
+    server->m_Cork = cork ? 1 : 0;
+    server->m_DataType = (DataType)data_type;
+    server->m_ChunkSize = chunk_size > 0 ? (uint32_t)chunk_size : 0;
+    server->m_Callback = dmScript::CreateCallback(L, callback_index);
+
+    if (g_Websocket.m_Servers.Full())
+        g_Websocket.m_Servers.OffsetCapacity(2);
+    g_Websocket.m_Servers.Push(server);
+
+    lua_pushlightuserdata(L, (void*)(uintptr_t)server->m_Handle);
     return 1;
+#endif
 }
 
-static int LuaDisconnect(lua_State* L)
+static int LuaCloseServer(lua_State* L)
 {
     DM_LUA_STACK_CHECK(L, 0);
 
@@ -204,62 +1999,125 @@ static int LuaDisconnect(lua_State* L)
         return DM_LUA_ERROR("The web socket module isn't initialized");
 
     if (!lua_islightuserdata(L, 1))
-        return DM_LUA_ERROR("The first argument must be a valid connection!");
+        return DM_LUA_ERROR("The first argument must be a valid server!");
+
+    WebsocketServer* server = FindServer(lua_touserdata(L, 1));
+    if (server)
+        CloseServer(server);
+    return 0;
+}
 
-    WebsocketConnection* conn = (WebsocketConnection*)lua_touserdata(L, 1);
+static dmBuffer::HBuffer CreateMessageBuffer(uint32_t size)
+{
+    const dmBuffer::StreamDeclaration streams_decl[] = {
+        {dmHashString64("data"), dmBuffer::VALUE_TYPE_UINT8, 1}
+    };
 
-    int i = FindConnection(conn);
-    if (i != -1)
+    dmBuffer::HBuffer buffer = 0;
+    dmBuffer::Result r = dmBuffer::Create(size, streams_decl, 1, &buffer);
+    if (dmBuffer::RESULT_OK != r)
     {
-        CloseConnection(conn);
+        dmLogError("Failed to create buffer for message: %d", r);
+        return 0;
     }
-    return 0;
+    return buffer;
 }
 
-static int LuaSend(lua_State* L)
+// Finds a buffer of the given size that isn't used by the current callback, or makes room for one.
+// Returns 0 if all pooled buffers are used
+static MessageBuffer* TakeMessageBuffer(lua_State* L, WebsocketConnection* conn, uint32_t size)
 {
-    DM_LUA_STACK_CHECK(L, 0);
+    dmArray<MessageBuffer>& pool = conn->m_MessageBufferPool;
+    uint32_t used = conn->m_MessageBuffersUsed;
+    if (used == MAX_POOLED_MESSAGE_BUFFERS)
+        return 0;
 
-    if (!g_Websocket.m_Initialized)
-        return DM_LUA_ERROR("The web socket module isn't initialized");
+    uint32_t index = used;
+    while (index < pool.Size() && pool[index].m_Size != size)
+        ++index;
 
-    if (!lua_islightuserdata(L, 1))
-        return DM_LUA_ERROR("The first argument must be a valid connection!");
+    if (index == pool.Size())
+    {
+        dmBuffer::HBuffer buffer = CreateMessageBuffer(size);
+        if (!buffer)
+            return 0;
 
-    WebsocketConnection* conn = (WebsocketConnection*)lua_touserdata(L, 1);
+        // Grow the pool, or replace a buffer of another size
+        if (pool.Size() < MAX_POOLED_MESSAGE_BUFFERS)
+        {
+            if (pool.Full())
+                pool.OffsetCapacity(2);
+            pool.SetSize(pool.Size() + 1);
+        }
+        else
+        {
+            index = used;
+            ReleaseMessageBuffer(L, &pool[index]);
+        }
 
-    int i = FindConnection(conn);
-    if (i == -1)
-        return DM_LUA_ERROR("Invalid connection");
+        dmScript::LuaHBuffer luabuf(buffer, dmScript::OWNER_C);
+        dmScript::PushBuffer(L, luabuf);
+        pool[index].m_Buffer = buffer;
+        pool[index].m_Ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+        pool[index].m_Size = size;
+    }
 
-    if (conn->m_State != STATE_CONNECTED)
-        return DM_LUA_ERROR("Connection isn't connected");
+    if (index != used)
+    {
+        MessageBuffer tmp = pool[used];
+        pool[used] = pool[index];
+        pool[index] = tmp;
+    }
 
-    size_t string_length = 0;
-    const char* string = luaL_checklstring(L, 2, &string_length);
+    ++conn->m_MessageBuffersUsed;
+    return &pool[used];
+}
 
-#if defined(HAVE_WSLAY)
-    int write_mode = WSLAY_BINARY_FRAME; // WSLAY_TEXT_FRAME
+// Pushes the payload of a received message, as a string or a buffer.
+// The buffers are reused by the following callbacks, which saves creating a buffer and a userdata for each message
+static void PushMessageData(lua_State* L, WebsocketConnection* conn, const Message* msg)
+{
+    // dmBuffer can't hold zero elements
+    if (!conn->m_MessageBuffers || msg->m_Length == 0)
+    {
+        lua_pushlstring(L, GetMessageData(msg), msg->m_Length);
+        return;
+    }
 
-    struct wslay_event_msg msg;
-    msg.opcode = write_mode;
-    msg.msg = (const uint8_t*)string;
-    msg.msg_length = string_length;
+    MessageBuffer* pooled = TakeMessageBuffer(L, conn, msg->m_Length);
+    dmBuffer::HBuffer buffer = pooled ? pooled->m_Buffer : CreateMessageBuffer(msg->m_Length);
+    if (!buffer)
+    {
+        lua_pushnil(L);
+        return;
+    }
 
-    wslay_event_queue_msg(conn->m_Ctx, &msg); // it makes a copy of the data
-#else
+    void* bytes = 0;
+    uint32_t size = 0;
+    dmBuffer::GetBytes(buffer, &bytes, &size);
+    memcpy(bytes, GetMessageData(msg), msg->m_Length);
 
-    dmSocket::Result sr = Send(conn, string, string_length, 0);
-    if (dmSocket::RESULT_OK != sr)
+    if (pooled)
     {
-        CLOSE_CONN("Failed to send on websocket");
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pooled->m_Ref);
+        return;
     }
-#endif
 
-    return 0;
+    // A batch with more messages than the pool holds. This one is freed when the buffer is collected
+    dmScript::LuaHBuffer luabuf(buffer, dmScript::OWNER_LUA);
+    dmScript::PushBuffer(L, luabuf);
+}
+
+static void PushMessageArray(lua_State* L, WebsocketConnection* conn, Message* const* messages, uint32_t num_messages)
+{
+    lua_createtable(L, num_messages, 0);
+    for (uint32_t i = 0; i < num_messages; ++i) {
+        PushMessageData(L, conn, messages[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
 }
 
-static void HandleCallback(WebsocketConnection* conn, int event)
+static void HandleCallback(WebsocketConnection* conn, int event, Message* const* messages, uint32_t num_messages)
 {
     if (!dmScript::IsCallbackValid(conn->m_Callback))
         return;
@@ -273,19 +2131,54 @@ static void HandleCallback(WebsocketConnection* conn, int event)
         return;
     }
 
-    lua_pushlightuserdata(L, conn);
+    PushHandle(L, conn);
+
+    // The buffers given to the previous callback can be reused
+    conn->m_MessageBuffersUsed = 0;
+
+    if (conn->m_PositionalCallback) {
+        // The payload is pushed as is, so a single message doesn't create a table
+        lua_pushinteger(L, event);
+        if (EVENT_ERROR == event || EVENT_RECONNECTING == event) {
+            lua_pushlstring(L, GetMessageData(messages[0]), messages[0]->m_Length);
+        }
+        else if (EVENT_MESSAGE == event && conn->m_BatchMessages) {
+            PushMessageArray(L, conn, messages, num_messages);
+        }
+        else if (EVENT_MESSAGE == event || EVENT_MESSAGE_CHUNK == event || EVENT_MESSAGE_END == event) {
+            PushMessageData(L, conn, messages[0]);
+        }
+        else {
+            lua_pushnil(L);
+        }
+
+        dmScript::PCall(L, 4, 0);
+
+        dmScript::TeardownCallback(conn->m_Callback);
+        return;
+    }
 
     lua_newtable(L);
 
     lua_pushinteger(L, event);
     lua_setfield(L, -2, "event");
 
-    if (EVENT_ERROR == event) {
-        lua_pushlstring(L, conn->m_Buffer, conn->m_BufferSize);
+    if (EVENT_ERROR == event || EVENT_RECONNECTING == event) {
+        lua_pushlstring(L, GetMessageData(messages[0]), messages[0]->m_Length);
         lua_setfield(L, -2, "error");
     }
     else if (EVENT_MESSAGE == event) {
-        lua_pushlstring(L, conn->m_Buffer, conn->m_BufferSize);
+        if (conn->m_BatchMessages) {
+            PushMessageArray(L, conn, messages, num_messages);
+            lua_setfield(L, -2, "messages");
+        }
+        else {
+            PushMessageData(L, conn, messages[0]);
+            lua_setfield(L, -2, "message");
+        }
+    }
+    else if (EVENT_MESSAGE_CHUNK == event || EVENT_MESSAGE_END == event) {
+        PushMessageData(L, conn, messages[0]);
         lua_setfield(L, -2, "message");
     }
 
@@ -294,6 +2187,71 @@ static void HandleCallback(WebsocketConnection* conn, int event)
     dmScript::TeardownCallback(conn->m_Callback);
 }
 
+// Delivers all messages received since the last update, either one callback per message,
+// or a single callback with all of them if the connection was created with batch_messages
+static void HandleMessages(WebsocketConnection* conn)
+{
+    uint32_t num_messages = conn->m_Messages.Size();
+    if (num_messages == 0)
+        return;
+
+    if (conn->m_BatchMessages)
+    {
+        HandleCallback(conn, EVENT_MESSAGE, conn->m_Messages.Begin(), num_messages);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < num_messages; ++i)
+            HandleCallback(conn, EVENT_MESSAGE, &conn->m_Messages[i], 1);
+    }
+
+    for (uint32_t i = 0; i < num_messages; ++i)
+        FreeMessage(conn->m_Messages[i]);
+    conn->m_Messages.SetSize(0);
+}
+
+// Delivers the events from the network side, in the order they happened.
+// Returns true once EVENT_DISCONNECTED has been delivered, and the connection can be destroyed
+// Delivers at most budget messages, the rest stay queued until the next update
+static bool DispatchEvents(WebsocketConnection* conn, uint32_t& budget)
+{
+    DM_PROFILE("WebsocketDispatchEvents");
+    bool finished = false;
+    Message* msg;
+    while (!finished && budget > 0 && conn->m_Inbound.Pop(&msg))
+    {
+        if (EVENT_MESSAGE == msg->m_Event || EVENT_MESSAGE_CHUNK == msg->m_Event || EVENT_MESSAGE_END == msg->m_Event)
+            --budget;
+
+        if (EVENT_MESSAGE == msg->m_Event)
+        {
+            if (conn->m_Messages.Full())
+                conn->m_Messages.OffsetCapacity(8);
+            conn->m_Messages.Push(msg);
+            continue;
+        }
+
+        // Messages received before this event are delivered first
+        HandleMessages(conn);
+
+        if (EVENT_CONNECTED == msg->m_Event)
+        {
+            conn->m_ScriptConnected = 1;
+        }
+        else if (EVENT_DISCONNECTED == msg->m_Event)
+        {
+            conn->m_ScriptClosed = 1;
+            finished = true;
+        }
+
+        HandleCallback(conn, msg->m_Event, &msg, 1);
+        FreeMessage(msg);
+    }
+
+    HandleMessages(conn);
+    return finished;
+}
+
 
 // ***************************************************************************************************
 // Life cycle functions
@@ -304,6 +2262,11 @@ static const luaL_reg Websocket_module_methods[] =
     {"connect", LuaConnect},
     {"disconnect", LuaDisconnect},
     {"send", LuaSend},
+    {"send_many", LuaSendMany},
+    {"listen", LuaListen},
+    {"close_server", LuaCloseServer},
+    {"get_buffered_amount", LuaGetBufferedAmount},
+    {"get_stats", LuaGetStats},
     {0, 0}
 };
 
@@ -322,6 +2285,15 @@ static void LuaInit(lua_State* L)
         SETCONSTANT(EVENT_DISCONNECTED);
         SETCONSTANT(EVENT_MESSAGE);
         SETCONSTANT(EVENT_ERROR);
+        SETCONSTANT(EVENT_MESSAGE_CHUNK);
+        SETCONSTANT(EVENT_MESSAGE_END);
+        SETCONSTANT(EVENT_RECONNECTING);
+
+        SETCONSTANT(DATA_TYPE_BINARY);
+        SETCONSTANT(DATA_TYPE_TEXT);
+
+        SETCONSTANT(PRIORITY_HIGH);
+        SETCONSTANT(PRIORITY_LOW);
 
 #undef SETCONSTANT
 
@@ -333,48 +2305,45 @@ static dmExtension::Result WebsocketAppInitialize(dmExtension::AppParams* params
 {
     g_Websocket.m_BufferSize = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.buffer_size", 64 * 1024);
     g_Websocket.m_Timeout = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.socket_timeout", 500 * 1000);
+    int recv_buffer_size = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.recv_buffer_size", 4 * 1024);
+    int send_buffer_size = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.send_buffer_size", 4 * 1024);
+    g_Websocket.m_RecvBufferSize = recv_buffer_size > 1024 ? (uint32_t)recv_buffer_size : 1024;
+    g_Websocket.m_SendBufferSize = send_buffer_size > 1024 ? (uint32_t)send_buffer_size : 1024;
+    int max_poll_time = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.max_poll_time_us", 0);
+    int max_messages = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.max_messages_per_update", 0);
+    g_Websocket.m_MaxPollTime = max_poll_time > 0 ? (uint64_t)max_poll_time : 0;
+    g_Websocket.m_MaxMessages = max_messages > 0 ? (uint32_t)max_messages : 0;
+    int max_connections = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.max_connections", 0);
+    g_Websocket.m_MaxConnections = max_connections > 0 ? (uint32_t)max_connections : 0;
+    int buffer_idle_time = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.buffer_idle_time", 10 * 1000 * 1000);
+    g_Websocket.m_BufferIdleTime = buffer_idle_time > 0 ? (uint64_t)buffer_idle_time : 0;
+    int ping_interval = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.ping_interval", 0);
+    int ping_timeout = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.ping_timeout", 0);
+    g_Websocket.m_PingInterval = ping_interval > 0 ? (uint64_t)ping_interval : 0;
+    g_Websocket.m_PingTimeout = ping_timeout > 0 ? (uint64_t)ping_timeout : 0;
+    int reconnect_delay = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.reconnect_delay", 500 * 1000);
+    int reconnect_max_delay = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.reconnect_max_delay", 30 * 1000 * 1000);
+    g_Websocket.m_ReconnectDelay = reconnect_delay > 0 ? (uint64_t)reconnect_delay : 0;
+    g_Websocket.m_ReconnectMaxDelay = reconnect_max_delay > 0 ? (uint64_t)reconnect_max_delay : 0;
     g_Websocket.m_Connections.SetCapacity(4);
-    g_Websocket.m_Channel = 0;
-    g_Websocket.m_Pool = 0;
-
-    dmConnectionPool::Params pool_params;
-    pool_params.m_MaxConnections = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.max_connections", 2);
-    dmConnectionPool::Result result = dmConnectionPool::New(&pool_params, &g_Websocket.m_Pool);
-
-    if (dmConnectionPool::RESULT_OK != result)
-    {
-        dmLogError("Failed to create connection pool: %d", result);
-    }
-
-// We can do without the channel, it will then fallback to the dmSocket::GetHostname (as opposed to dmDNS::GetHostname)
-#if defined(HAVE_WSLAY)
-    dmDNS::Result dns_result = dmDNS::NewChannel(&g_Websocket.m_Channel);
-
-    if (dmDNS::RESULT_OK != dns_result)
-    {
-        dmLogError("Failed to create connection pool: %d", dns_result);
-    }
-#endif
+    g_Websocket.m_NetConnections.SetCapacity(4);
+    g_Websocket.m_Mutex = 0;
 
+// There are no threads available to the extension in the browser
 #if defined(__EMSCRIPTEN__)
-    // avoid mixed content warning if trying to access wss resource from http page
-    // If not using this, we get EHOSTUNREACH
-    EM_ASM({
-        Module["websocket"].url = window["location"]["protocol"].replace("http", "ws") + "//";
-    });
+    g_Websocket.m_Threaded = 0;
+#else
+    g_Websocket.m_Threaded = dmConfigFile::GetInt(params->m_ConfigFile, "websocket.threaded", 0) ? 1 : 0;
 #endif
 
     g_Websocket.m_Initialized = 1;
-    if (!g_Websocket.m_Pool)
-    {
-        if (!g_Websocket.m_Pool)
-        {
-            dmLogInfo("pool is null!");
-            dmConnectionPool::Delete(g_Websocket.m_Pool);
-        }
 
-        dmLogInfo("%s extension not initialized", MODULE_NAME);
-        g_Websocket.m_Initialized = 0;
+    if (g_Websocket.m_Threaded)
+    {
+        g_Websocket.m_Mutex = dmMutex::New();
+        g_Websocket.m_Wake = dmConditionVariable::New();
+        dmAtomicStore32(&g_Websocket.m_ThreadRunning, 1);
+        g_Websocket.m_Thread = dmThread::New(NetworkThread, 0x80000, 0, "websocket");
     }
 
     return dmExtension::RESULT_OK;
@@ -393,185 +2362,78 @@ static dmExtension::Result WebsocketInitialize(dmExtension::Params* params)
 
 static dmExtension::Result WebsocketAppFinalize(dmExtension::AppParams* params)
 {
+    if (g_Websocket.m_Mutex)
+    {
+        dmAtomicStore32(&g_Websocket.m_ThreadRunning, 0);
+        {
+            DM_MUTEX_SCOPED_LOCK(g_Websocket.m_Mutex);
+            dmConditionVariable::Signal(g_Websocket.m_Wake);
+        }
+        dmThread::Join(g_Websocket.m_Thread);
+        dmConditionVariable::Delete(g_Websocket.m_Wake);
+        dmMutex::Delete(g_Websocket.m_Mutex);
+        g_Websocket.m_Mutex = 0;
+    }
+#if !defined(__EMSCRIPTEN__)
+    StopConnectWorker();
+#endif
 
-    dmConnectionPool::Shutdown(g_Websocket.m_Pool, dmSocket::SHUTDOWNTYPE_READWRITE);
     return dmExtension::RESULT_OK;
 }
 
 static dmExtension::Result WebsocketFinalize(dmExtension::Params* params)
 {
+    // Frees the ports
+    while (!g_Websocket.m_Servers.Empty())
+        CloseServer(g_Websocket.m_Servers.Back());
     return dmExtension::RESULT_OK;
 }
 
 static dmExtension::Result WebsocketOnUpdate(dmExtension::Params* params)
 {
-    uint32_t size = g_Websocket.m_Connections.Size();
+    DM_PROFILE("WebsocketOnUpdate");
 
-    for (uint32_t i = 0; i < size; ++i)
-    {
-        WebsocketConnection* conn = g_Websocket.m_Connections[i];
+    AcceptConnections();
 
-        if (STATE_DISCONNECTED == conn->m_State)
-        {
-            if (RESULT_OK != conn->m_Status)
-            {
-                HandleCallback(conn, EVENT_ERROR);
-            }
+    // In threaded mode, the network thread does this
+    if (!g_Websocket.m_Threaded)
+        UpdateConnections(g_Websocket.m_NetConnections);
 
-            HandleCallback(conn, EVENT_DISCONNECTED);
+    uint32_t size = g_Websocket.m_Connections.Size();
 
-            g_Websocket.m_Connections.EraseSwap(i);
-            --i;
-            --size;
-            DestroyConnection(conn);
-        }
-        else if (STATE_CONNECTED == conn->m_State)
-        {
-#if defined(HAVE_WSLAY)
-            int r = WSL_Poll(conn->m_Ctx);
-            if (0 != r)
-            {
-                CLOSE_CONN("Websocket closing for %s (%s)", conn->m_Url.m_Hostname, WSL_ResultToString(r));
-                continue;
-            }
-            r = WSL_WantsExit(conn->m_Ctx);
-            if (0 != r)
-            {
-                CLOSE_CONN("Websocket received close event for %s", conn->m_Url.m_Hostname);
-                continue;
-            }
-#else
-            int recv_bytes = 0;
-            dmSocket::Result sr = Receive(conn, conn->m_Buffer, conn->m_BufferCapacity-1, &recv_bytes);
-            if( sr == dmSocket::RESULT_WOULDBLOCK )
-            {
-                continue;
-            }
+    // Once the budget is spent, the remaining connections dispatch nothing, and go first in the next update.
+    // Their sends still go to the network side
+    uint32_t budget = g_Websocket.m_MaxMessages ? g_Websocket.m_MaxMessages : 0xFFFFFFFF;
+    uint32_t first = size ? g_Websocket.m_ScriptStart % size : 0;
+    g_Websocket.m_ScriptStart = first + 1;
+    bool over_budget = false;
+    for (uint32_t n = 0; n < size; ++n)
+    {
+        WebsocketConnection* conn = g_Websocket.m_Connections[(first + n) % size];
 
-            if (dmSocket::RESULT_OK == sr)
-            {
-                conn->m_BufferSize += recv_bytes;
-                conn->m_Buffer[conn->m_BufferCapacity-1] = 0;
-                conn->m_HasMessage = 1;
-            }
-            else
-            {
-                CLOSE_CONN("Websocket failed to receive data %s", dmSocket::ResultToString(sr));
-                continue;
-            }
-#endif
+        FlushPending(conn->m_Outbound, conn->m_OutboundPending);
+        ReleaseSendSources(conn, false);
 
-            if (conn->m_HasMessage)
-            {
-                HandleCallback(conn, EVENT_MESSAGE);
-                conn->m_HasMessage = 0;
-                conn->m_BufferSize = 0;
-            }
-        }
-        else if (STATE_HANDSHAKE_READ == conn->m_State)
+        if (!over_budget && budget == 0)
         {
-            Result result = ReceiveHeaders(conn);
-            if (RESULT_WOULDBLOCK == result)
-            {
-                continue;
-            }
-
-            if (RESULT_OK != result)
-            {
-                CLOSE_CONN("Failed receiving handshake headers. %d", result);
-                continue;
-            }
-
-            result = VerifyHeaders(conn);
-            if (RESULT_OK != result)
-            {
-                CLOSE_CONN("Failed verifying handshake headers:\n%s\n\n", conn->m_Buffer);
-                continue;
-            }
-
-#if defined(HAVE_WSLAY)
-            int r = WSL_Init(&conn->m_Ctx, g_Websocket.m_BufferSize, (void*)conn);
-            if (0 != r)
-            {
-                CLOSE_CONN("Failed initializing wslay: %s", WSL_ResultToString(r));
-                continue;
-            }
-
-            dmSocket::SetNoDelay(conn->m_Socket, true);
-            // Don't go lower than 1000 since some platforms might not have that good precision
-            dmSocket::SetReceiveTimeout(conn->m_Socket, 1000);
-            if (conn->m_SSLSocket)
-                dmSSLSocket::SetReceiveTimeout(conn->m_SSLSocket, 1000);
-#endif
-            dmSocket::SetBlocking(conn->m_Socket, false);
-
-            conn->m_Buffer[0] = 0;
-            conn->m_BufferSize = 0;
-
-            SetState(conn, STATE_CONNECTED);
-            HandleCallback(conn, EVENT_CONNECTED);
+            g_Websocket.m_ScriptStart = first + n;
+            over_budget = true;
         }
-        else if (STATE_HANDSHAKE_WRITE == conn->m_State)
-        {
-            Result result = SendClientHandshake(conn);
-            if (RESULT_WOULDBLOCK == result)
-            {
-                continue;
-            }
-            if (RESULT_OK != result)
-            {
-                CLOSE_CONN("Failed sending handshake: %d", result);
-                continue;
-            }
+        if (over_budget)
+            continue;
+        conn->m_ScriptFinished = DispatchEvents(conn, budget) ? 1 : 0;
+    }
 
-            SetState(conn, STATE_HANDSHAKE_READ);
-        }
-        else if (STATE_CONNECTING == conn->m_State)
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        WebsocketConnection* conn = g_Websocket.m_Connections[i];
+        if (conn->m_ScriptFinished)
         {
-#if defined(__EMSCRIPTEN__)
-            conn->m_SSLSocket = dmSSLSocket::INVALID_SOCKET_HANDLE;
-
-            char uri_buffer[dmURI::MAX_URI_LEN];
-            const char* uri;
-            if (conn->m_Url.m_Path[0] != '\0') {
-                dmSnPrintf(uri_buffer, sizeof(uri_buffer), "%s%s", conn->m_Url.m_Hostname, conn->m_Url.m_Path);
-                uri = uri_buffer;
-            } else {
-                uri = conn->m_Url.m_Hostname;
-            }
-
-            dmSocket::Address address;
-            dmSocket::Result sr = dmSocket::GetHostByName(uri, &address, true, false);
-            if (dmSocket::RESULT_OK != sr) {
-                CLOSE_CONN("Failed to get address from host name '%s': %s", uri, dmSocket::ResultToString(sr));
-                continue;
-            }
-
-            sr = dmSocket::New(address.m_family, dmSocket::TYPE_STREAM, dmSocket::PROTOCOL_TCP, &conn->m_Socket);
-            if (dmSocket::RESULT_OK != sr) {
-                CLOSE_CONN("Failed to create socket for '%s': %s", conn->m_Url.m_Hostname, dmSocket::ResultToString(sr));
-                continue;
-            }
-
-            sr = dmSocket::Connect(conn->m_Socket, address, conn->m_Url.m_Port);
-            if (dmSocket::RESULT_OK != sr) {
-                CLOSE_CONN("Failed to connect to '%s:%d': %s", conn->m_Url.m_Hostname, (int)conn->m_Url.m_Port, dmSocket::ResultToString(sr));
-                continue;
-            }
-#else
-            dmSocket::Result sr;
-            int timeout = g_Websocket.m_Timeout;
-            dmConnectionPool::Result pool_result = dmConnectionPool::Dial(g_Websocket.m_Pool, conn->m_Url.m_Hostname, conn->m_Url.m_Port, g_Websocket.m_Channel, conn->m_SSL, timeout, &conn->m_Connection, &sr);
-            if (dmConnectionPool::RESULT_OK != pool_result)
-            {
-                CLOSE_CONN("Failed to open connection: %s", dmSocket::ResultToString(sr));
-                continue;
-            }
-            conn->m_Socket = dmConnectionPool::GetSocket(g_Websocket.m_Pool, conn->m_Connection);
-            conn->m_SSLSocket = dmConnectionPool::GetSSLSocket(g_Websocket.m_Pool, conn->m_Connection);
-#endif
-
-            SetState(conn, STATE_HANDSHAKE_WRITE);
+            g_Websocket.m_Connections.EraseSwap(i);
+            --i;
+            --size;
+            FreeHandle(conn);
+            DestroyConnection(conn);
         }
     }
 
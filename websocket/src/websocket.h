@@ -15,11 +15,18 @@
     #include <wslay/wslay.h>
 #endif
 
-#include <dmsdk/dlib/connection_pool.h>
+// HAVE_ZLIB is defined in ext.manifest, for the platforms whose sdk has zlib, see deflate.cpp
+#if defined(HAVE_ZLIB) && !defined(HAVE_WSLAY)
+    #error "permessage-deflate needs the native websocket implementation"
+#endif
+
 #include <dmsdk/dlib/socket.h>
-#include <dmsdk/dlib/dns.h>
+#include <dmsdk/dlib/sslsocket.h>
+#include <dmsdk/dlib/thread.h>
 #include <dmsdk/dlib/uri.h>
 
+#include "ringbuffer.h"
+
 namespace dmCrypt
 {
     void HashSha1(const uint8_t* buf, uint32_t buflen, uint8_t* digest);
@@ -31,14 +38,25 @@ namespace dmWebsocket
 {
     // Maximum time to wait for a socket
     static const int SOCKET_WAIT_TIMEOUT = 4*1000;
+    // Number of messages that can be in flight between the network side and the script side
+    static const uint32_t MESSAGE_QUEUE_SIZE = 256;
+    // Corked frames are written in pieces of at most this size, which is the size of a tls record
+    static const uint32_t CORK_BUFFER_SIZE = 16 * 1024;
+    // The connection buffer starts at this size, and doubles as needed
+    static const uint32_t BUFFER_INITIAL_SIZE = 1024;
 
     enum State
     {
         STATE_CONNECTING,
+        STATE_RESOLVING,
+        STATE_TCP_CONNECTING,
+        STATE_TLS_HANDSHAKE,
         STATE_HANDSHAKE_WRITE,
         STATE_HANDSHAKE_READ,
         STATE_CONNECTED,
+        STATE_CLOSING,          // The script closed the connection, and the queued messages and the close frame go out
         STATE_DISCONNECTED,
+        STATE_RECONNECT_WAIT,   // The connection dropped, and waits to connect again
     };
 
     enum Result
@@ -57,8 +75,96 @@ namespace dmWebsocket
         EVENT_DISCONNECTED,
         EVENT_MESSAGE,
         EVENT_ERROR,
+        EVENT_MESSAGE_CHUNK,    // A part of a message bigger than the chunk_size of the connection
+        EVENT_MESSAGE_END,      // The last part of such a message
+        EVENT_RECONNECTING,     // The connection dropped, or a reconnect failed, and it will connect again
+    };
+
+    enum DataType
+    {
+        DATA_TYPE_BINARY,
+        DATA_TYPE_TEXT,
+    };
+
+    // The send lanes of websocket.send()
+    enum Priority
+    {
+        PRIORITY_HIGH,
+        PRIORITY_LOW,   // Waits until the messages sent at high priority are out
+    };
+
+    // Random numbers (PCG)
+    typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
+    void pcg32_srandom_r(pcg32_random_t* rng, uint64_t initstate, uint64_t initseq);
+    void pcg32_srandom_entropy_r(pcg32_random_t* rng); // Seeds from the OS entropy source, if there is one
+    uint32_t pcg32_random_r(pcg32_random_t* rng);
+    void pcg32_random_bytes_r(pcg32_random_t* rng, uint8_t* buffer, uint32_t size);
+
+    // Outbound only: the payload of the message is sent as a text frame
+    static const uint32_t OUTBOUND_TEXT_MESSAGE = 0x100;
+    // Outbound only: the payload of the message is a SendSource pointer
+    static const uint32_t OUTBOUND_SEND_SOURCE = 0x101;
+    // Outbound only: flag for a message that goes into the low priority lane, see FeedLowPriority()
+    static const uint32_t OUTBOUND_LOW_PRIORITY = 0x1000;
+
+    struct Message
+    {
+        uint32_t m_Length;  // The payload follows the header, see GetMessageData()
+        uint32_t m_Event;   // Inbound: the Event. Outbound: EVENT_MESSAGE, OUTBOUND_TEXT_MESSAGE, OUTBOUND_SEND_SOURCE, or EVENT_DISCONNECTED to request a close
+    };
+
+    // A payload passed to websocket.send_many(), shared by the send sources of all its connections. Script side only
+    struct SharedPayload
+    {
+        int             m_Ref;      // Keeps the Lua string or buffer alive while it's being sent
+        uint32_t        m_RefCount; // Send sources that haven't been released yet
+    };
+
+    // A buffer passed to websocket.send(). It's sent as fragments read straight from the buffer memory
+    struct SendSource
+    {
+        const uint8_t*  m_Data;
+        uint32_t        m_Size;
+        uint32_t        m_Offset;   // Network side: bytes read so far
+        DataType        m_DataType;
+        int             m_Ref;      // Script side: keeps the Lua buffer alive while it's being sent
+        SharedPayload*  m_Shared;   // Script side: holds the reference instead, if the data is sent on several connections
+        int32_atomic_t  m_Done;     // Set by the network side once the data isn't used anymore
+    };
+
+    // A buffer given to the script for a received message. It's reused for later messages of the same size
+    struct MessageBuffer
+    {
+        dmBuffer::HBuffer   m_Buffer;
+        int                 m_Ref;      // The Lua userdata of the buffer, pushed again when it's reused
+        uint32_t            m_Size;
     };
 
+    // Network side counters, see websocket.get_stats()
+    struct Stats
+    {
+        uint64_t    m_BytesSent;            // On the socket, including the handshake and the frame headers
+        uint64_t    m_BytesReceived;
+        uint64_t    m_MessagesSent;         // Messages queued for sending
+        uint64_t    m_MessagesReceived;
+        uint64_t    m_FramesReceived;
+        uint64_t    m_Polls;                // Polls that read from the socket
+        uint32_t    m_LastPollFrames;       // Frames received by the most recent of those polls
+        uint32_t    m_QueuedMessageCount;   // Waiting to be sent by wslay
+        uint64_t    m_QueuedMessageLength;
+        uint64_t    m_ConnectTime;          // (us) Resolving the host name, and the tcp connect
+        uint64_t    m_TlsTime;              // (us) The tls handshake
+        uint64_t    m_HttpTime;             // (us) The http upgrade request and response
+        uint64_t    m_PollTime;             // (us) Total time spent in WSL_Poll()
+        uint64_t    m_Pongs;                // Pongs matching our pings, see keepalive.cpp
+        uint64_t    m_LastRtt;              // (us)
+        uint64_t    m_Rtt;                  // (us) Smoothed round trip time
+        uint64_t    m_RttJitter;            // (us) Smoothed deviation of the round trip time
+        uint64_t    m_Reconnects;           // Reconnect attempts
+    };
+
+    struct WebsocketServer;
+
     struct WebsocketConnection
     {
         dmScript::LuaCallbackInfo*      m_Callback;
@@ -66,17 +172,113 @@ namespace dmWebsocket
         wslay_event_context_ptr         m_Ctx;
 #endif
         dmURI::Parts                    m_Url;
-        dmConnectionPool::HConnection   m_Connection;
+        char*                           m_Protocol;         // Optional Sec-WebSocket-Protocol value
+        char*                           m_CustomHeaders;    // Optional extra handshake headers, "Key: Value\r\n" lines
+        dmSocket::Address               m_Address;
         dmSocket::Socket                m_Socket;
         dmSSLSocket::Socket             m_SSLSocket;
+#if defined(__EMSCRIPTEN__)
+        int                             m_BrowserSocket;    // The id of the browser WebSocket, 0 if none, see browser.cpp
+#endif
+        uint64_t                        m_ConnectStart;     // Time (us) when the tcp connect was started
         uint8_t                         m_Key[16];
+        pcg32_random_t                  m_Rnd;              // For the handshake key and the frame masks
         State                           m_State;
+        uint64_t                        m_StateStart;       // Time (us) when m_State was entered
+        Stats                           m_Stats;            // Network side
+        Stats                           m_PublishedStats;   // Threaded mode: a copy of m_Stats, protected by the context mutex
         uint32_t                        m_SSL:1;
-        uint32_t                        m_HasMessage:1;
-        char*                           m_Buffer;
+        uint32_t                        m_Accepted:1;       // Accepted by a server, see websocket.listen(). It answers the handshake
+        uint32_t                        m_BatchMessages:1;
+        uint32_t                        m_MessageBuffers:1; // Deliver messages as buffers instead of strings
+        uint32_t                        m_PositionalCallback:1; // Call back with (self, conn, event, payload) instead of an event table
+        DataType                        m_DataType;         // The default frame type for websocket.send()
+        uint8_t                         m_Cork;             // Gather the frames of an update into one write
+        char*                           m_CorkBuffer;       // Network side: frames not yet written, see WSL_SendCallback()
+        uint32_t                        m_CorkSize;
+        char*                           m_Buffer;           // Handshake data and the error message. Once connected, received frame data that didn't fit in wslay yet
         int                             m_BufferSize;
-        uint32_t                        m_BufferCapacity;
+        uint32_t                        m_BufferCapacity;   // 0 until the buffer is needed, see GrowBuffer()
+        uint32_t                        m_MaxMessageSize;   // The biggest received message, and the most m_Buffer grows to
+        uint32_t                        m_HeaderScanned;    // Handshake: bytes of m_Buffer searched for the end of the headers
+        uint32_t                        m_HeaderLength;     // Handshake: size of the response headers, including the empty line
         Result                          m_Status;
+
+        // permessage-deflate (RFC 7692), see deflate.cpp
+        struct DeflateState*            m_Deflate;          // Network side: the zlib streams, once negotiated
+        uint32_t                        m_DeflateMinSize;   // Smaller messages are sent uncompressed
+        uint8_t                         m_DeflateRequested; // Offered in the handshake
+        uint8_t                         m_DeflateEnabled;   // Accepted by the server
+        uint8_t                         m_DeflateWindowBits;        // client_max_window_bits
+        uint8_t                         m_DeflateNoContextTakeover; // client_no_context_takeover
+
+        // Network side: the message being received, see wslay_callbacks.cpp
+        Message*                        m_RecvMessage;
+        uint32_t                        m_RecvCapacity;
+        uint64_t                        m_RecvFrameRemaining; // Streamed messages: payload of the current frame not yet copied
+        uint8_t                         m_RecvControlFrame; // The current frame is a control frame, which wslay handles
+        uint8_t                         m_RecvDiscard;      // A message was too big, and the connection is closing
+        uint8_t                         m_RecvDrained;      // The last read found no more data
+        uint8_t                         m_RecvCompressed;   // The current message is compressed, and isn't streamed
+        uint8_t                         m_RecvChunked;      // Parts of the current message have been delivered as chunks
+        uint8_t                         m_RecvInMessage;    // A data message has started, and m_RecvMessage is in use
+        uint32_t                        m_ChunkSize;        // If not 0, bigger messages are delivered in chunks of this size
+        uint8_t                         m_Readable;         // The socket has data to read, set by PollSockets() each update
+        uint64_t                        m_RecvDeadline;     // Time (us) when reading stops for this update, 0 if never
+        uint64_t                        m_IdleMessages;     // Data messages sent and received when the connection was last seen busy, see TrimBuffers()
+        uint64_t                        m_IdleStart;        // Time (us) the connection was last seen busy
+        uint8_t                         m_BuffersTrimmed;   // The buffers have been released since the connection went idle
+
+        // Network side: pings, see keepalive.cpp
+        uint64_t                        m_PingTime;         // Time (us) the last ping was sent
+        uint64_t                        m_PingUnanswered;   // Time (us) the outstanding ping was sent or anything was last received since, 0 if none
+        uint8_t                         m_PingOutstanding;  // No pong to the last ping yet
+
+        // Blocking parts of connecting that run on the connect worker thread, see connect.cpp
+        dmThread::ThreadStart           m_Job;
+        int32_atomic_t                  m_JobDone;
+        int                             m_JobResult;
+        uint64_t                        m_JobTimeout;
+        uint8_t                         m_JobRunning;
+        uint8_t                         m_AddressResolved;  // m_Address holds the address of the host, so a reconnect needn't look it up
+
+        // Reconnecting when the connection drops, see ScheduleReconnect()
+        uint8_t                         m_Reconnect;        // Enabled for the connection
+        uint8_t                         m_WasConnected;     // Network side: the connection was up, so it reconnects if it drops
+        uint8_t                         m_Reconnecting;     // Network side: the connection dropped, and isn't up again yet
+        uint32_t                        m_ReconnectAttempts;    // Network side: attempts since the connection was last up
+        uint32_t                        m_MaxReconnectAttempts; // 0 if unlimited
+        uint64_t                        m_ReconnectTime;    // Network side: time (us) of the next attempt
+        int32_atomic_t                  m_CloseRequested;   // Set by the script side, so the connection doesn't reconnect
+        uint8_t                         m_CloseQueued;      // Network side: in STATE_CLOSING, the close frame is queued in wslay
+
+        // Hand-off between the network side and the script side. In threaded mode, they run on different threads
+        RingBuffer<Message>             m_Inbound;          // Events, produced by the network side
+        RingBuffer<Message>             m_Outbound;         // Messages to send, produced by the script side (threaded mode, or reconnecting connections)
+        dmArray<Message*>               m_InboundPending;   // Network side: events not yet fitting in m_Inbound
+        dmArray<Message*>               m_OutboundPending;  // Script side: messages not yet fitting in m_Outbound
+        int32_atomic_t                  m_OutboundBytes;    // Bytes in m_Outbound and m_OutboundPending
+        int32_atomic_t                  m_BufferedAmount;   // Bytes queued in wslay, published by the network side (threaded mode)
+        uint32_t                        m_SendSourceBytes;  // Network side: bytes of queued buffers not yet read by wslay
+        dmArray<SendSource*>            m_QueuedSources;    // Network side: buffers queued in wslay, and not yet read to the end
+
+        // Network side: the low priority lane, handed to wslay one message at a time, see FeedLowPriority()
+        dmArray<Message*>               m_LowPriority;      // Outbound messages, in order from m_LowPriorityFirst
+        uint32_t                        m_LowPriorityFirst;
+        uint32_t                        m_LowPriorityBytes; // Bytes in the lane, and not yet read of m_LowMessage
+        Message*                        m_LowMessage;       // Being read by wslay as fragments
+        uint32_t                        m_LowOffset;        // Bytes of m_LowMessage read so far
+
+        // Script side only
+        uint32_t                        m_Handle;           // The handle given to Lua, see FindConnection()
+        WebsocketServer*                m_Server;           // The server that accepted the connection, which owns m_Callback
+        dmArray<Message*>               m_Messages;         // Received messages, delivered in order after each poll
+        dmArray<SendSource*>            m_SendSources;      // Buffers being sent
+        dmArray<MessageBuffer>          m_MessageBufferPool; // See PushMessageData()
+        uint32_t                        m_MessageBuffersUsed; // Taken from the pool by the current callback
+        uint8_t                         m_ScriptConnected;  // EVENT_CONNECTED has been dispatched
+        uint8_t                         m_ScriptClosed;     // A close has been requested, or EVENT_DISCONNECTED dispatched
+        uint8_t                         m_ScriptFinished;   // EVENT_DISCONNECTED has been dispatched, and the connection can be destroyed
     };
 
     // Set error message
@@ -85,35 +287,101 @@ namespace dmWebsocket
 #else
     Result SetStatus(WebsocketConnection* conn, Result status, const char* fmt, ...);
 #endif
+    // Network side: also accumulates the time spent in the previous state
+    void SetState(WebsocketConnection* conn, State state);
+
+    // Messages
+    Message*    NewMessage(uint32_t event, const void* data, uint32_t length); // Returns 0 if out of memory
+    Message*    ResizeMessage(Message* msg, uint32_t capacity); // Keeps the payload, capacity excludes the null character. Returns 0 if out of memory, and msg is kept
+    void        FreeMessage(Message* msg);
+    // Network side: queue an event for the script side
+    bool        PushEvent(WebsocketConnection* conn, Event event, const void* data, uint32_t length); // Returns false if out of memory, and the event is dropped
+    // Network side: queue a message without copying it. The queue takes ownership
+    void        PushMessage(WebsocketConnection* conn, Message* msg);
+
+    static inline const char* GetMessageData(const Message* msg)
+    {
+        return (const char*)(msg + 1);
+    }
+
+    // Makes room for size bytes in m_Buffer, growing it geometrically, but not beyond m_MaxMessageSize.
+    // Returns false if it can't hold size bytes, or is out of memory
+    bool        GrowBuffer(WebsocketConnection* conn, uint32_t size);
+    // Shrinks m_Buffer to the data it holds, and frees it if there is none
+    void        FitBuffer(WebsocketConnection* conn);
 
     // Communication
+    // Send() does a single non blocking write, and may send only a part of the buffer
     dmSocket::Result Send(WebsocketConnection* conn, const char* buffer, int length, int* out_sent_bytes);
+    // SendAll() waits for the socket until the whole buffer is sent, or the timeout (us) is up
+    dmSocket::Result SendAll(WebsocketConnection* conn, const char* buffer, int length, uint64_t timeout);
     dmSocket::Result Receive(WebsocketConnection* conn, void* buffer, int length, int* received_bytes);
     dmSocket::Result WaitForSocket(WebsocketConnection* conn, dmSocket::SelectorKind kind, int timeout);
+    void CloseSocket(WebsocketConnection* conn);
+    // Server side: a non blocking socket, listening on the address of host
+    dmSocket::Result OpenListenSocket(const char* host, uint16_t port, dmSocket::Socket* out_socket);
+
+    // Connecting. Each step is polled, and returns RESULT_WOULDBLOCK until done
+    void   StartResolve(WebsocketConnection* conn);
+    Result PollResolve(WebsocketConnection* conn);
+    Result StartConnect(WebsocketConnection* conn);
+    Result PollConnect(WebsocketConnection* conn, uint64_t timeout);
+    void   StartTlsHandshake(WebsocketConnection* conn, uint64_t timeout);
+    Result PollTlsHandshake(WebsocketConnection* conn);
+    bool   FinishConnectJob(WebsocketConnection* conn); // Returns false while a job is still running
+    void   StopConnectWorker();
+
+    // Compression, only available if HAVE_ZLIB is defined
+    Result DeflateInit(WebsocketConnection* conn);
+    void   DeflateExit(WebsocketConnection* conn);
+    // Returns false if the message should be sent as is
+    bool   DeflateCompress(WebsocketConnection* conn, const void* data, uint32_t length, const uint8_t** out, uint32_t* out_length);
+    // Returns 0, or a websocket close code
+    int    DeflateDecompress(WebsocketConnection* conn, const void* data, uint32_t length, const uint8_t** out, uint32_t* out_length);
+    // Frees the output buffer, which otherwise keeps the size of the biggest message
+    void   DeflateTrim(WebsocketConnection* conn);
+
+    // Keepalive, only available if HAVE_WSLAY is defined
+    void   StartKeepalive(WebsocketConnection* conn);
+    // Any received frame counts as a sign of life for the ping timeout
+    void   HandleInbound(WebsocketConnection* conn);
+    // Sends a ping every interval (us). Fails if a ping isn't answered within timeout (us), unless it's 0
+    Result UpdateKeepalive(WebsocketConnection* conn, uint64_t interval, uint64_t timeout);
+    void   HandlePong(WebsocketConnection* conn, const uint8_t* data, uint32_t length);
 
-    // Handshake
-    Result SendClientHandshake(WebsocketConnection* conn);
+    // The browser WebSocket, only available if __EMSCRIPTEN__ is defined. The browser connects, and delivers the
+    // messages as they arrive, so the connection goes to STATE_CONNECTED or STATE_DISCONNECTED in between updates
+    Result   BrowserConnect(WebsocketConnection* conn);
+    bool     BrowserSend(WebsocketConnection* conn, const char* data, uint32_t length, DataType type);
+    uint32_t BrowserGetBufferedAmount(WebsocketConnection* conn);
+    void     BrowserClose(WebsocketConnection* conn);
+
+    // Handshake, not used on HTML5
+    Result SendClientHandshake(WebsocketConnection* conn, uint64_t timeout);
     Result ReceiveHeaders(WebsocketConnection* conn);
     Result VerifyHeaders(WebsocketConnection* conn);
+    // Server side: answers the request found by ReceiveHeaders(), with a rejection if it isn't a valid upgrade
+    Result AnswerClientHandshake(WebsocketConnection* conn, uint64_t timeout);
 
 #if defined(HAVE_WSLAY)
     // Wslay callbacks
-    int     WSL_Init(wslay_event_context_ptr* ctx, ssize_t buffer_size, void* userctx);
+    int     WSL_Init(wslay_event_context_ptr* ctx, ssize_t buffer_size, uint32_t recv_buffer_size, uint32_t send_buffer_size, void* userctx, bool server);
     void    WSL_Exit(wslay_event_context_ptr ctx);
     int     WSL_Close(wslay_event_context_ptr ctx);
-    int     WSL_Poll(wslay_event_context_ptr ctx);
+    int     WSL_Poll(wslay_event_context_ptr ctx, bool recv); // Only sends if there is something to send
+    void    WSL_FlushCork(wslay_event_context_ptr ctx, uint64_t timeout); // Writes the corked frames before the context goes away
     int     WSL_WantsExit(wslay_event_context_ptr ctx);
     ssize_t WSL_RecvCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, int flags, void *user_data);
     ssize_t WSL_SendCallback(wslay_event_context_ptr ctx, const uint8_t *data, size_t len, int flags, void *user_data);
+    void    WSL_OnFrameRecvStartCallback(wslay_event_context_ptr ctx, const struct wslay_event_on_frame_recv_start_arg *arg, void *user_data);
+    void    WSL_OnFrameRecvChunkCallback(wslay_event_context_ptr ctx, const struct wslay_event_on_frame_recv_chunk_arg *arg, void *user_data);
+    uint8_t* WSL_RecvPayloadBufferCallback(wslay_event_context_ptr ctx, uint64_t len, size_t* buflen, void* user_data);
+    ssize_t WSL_ReadLowPriorityCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, const union wslay_event_msg_source *source, int *eof, void *user_data);
+    ssize_t WSL_ReadSendSourceCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, const union wslay_event_msg_source *source, int *eof, void *user_data);
     void    WSL_OnMsgRecvCallback(wslay_event_context_ptr ctx, const struct wslay_event_on_msg_recv_arg *arg, void *user_data);
     int     WSL_GenmaskCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, void *user_data);
     const char* WSL_ResultToString(int err);
 #endif
-
-    // Random numbers (PCG)
-    typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
-    void pcg32_srandom_r(pcg32_random_t* rng, uint64_t initstate, uint64_t initseq);
-    uint32_t pcg32_random_r(pcg32_random_t* rng);
 }
 
 
@@ -85,19 +85,46 @@ static const uint8_t utf8d[] = {
   12,36,12,12,12,12,12,12,12,12,12,12,
 };
 
-static uint32_t
-decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
-  uint32_t type = utf8d[byte];
-
-  *codep = (*state != UTF8_ACCEPT) ?
-    (byte & 0x3fu) | (*codep << 6) :
-    (0xff >> type) & (byte);
+/* End of utf8 dfa */
 
-  *state = utf8d[256 + *state + type];
-  return *state;
+/*
+ * Runs the utf8 dfa over data. While the dfa is between characters,
+ * ASCII is skipped a word at a time, and only non-ASCII bytes are
+ * decoded one at a time. Returns the new state.
+ */
+static uint32_t validate_utf8(uint32_t state, const uint8_t *data,
+                              size_t len) {
+  size_t i = 0;
+  while(i < len) {
+    if(state == UTF8_ACCEPT) {
+      uint64_t w[2];
+      while(len - i >= sizeof(w)) {
+        memcpy(w, data + i, sizeof(w));
+        if(((w[0] | w[1]) & 0x8080808080808080ull) != 0) {
+          break;
+        }
+        i += sizeof(w);
+      }
+      while(i < len && data[i] < 0x80) {
+        ++i;
+      }
+      if(i == len) {
+        break;
+      }
+    }
+    state = utf8d[256 + state + utf8d[data[i]]];
+    if(state == UTF8_REJECT) {
+      break;
+    }
+    ++i;
+  }
+  return state;
 }
 
-/* End of utf8 dfa */
+int wslay_event_validate_utf8(const uint8_t *data, size_t len)
+{
+  return validate_utf8(UTF8_ACCEPT, data, len) == UTF8_ACCEPT;
+}
 
 static ssize_t wslay_event_frame_recv_callback(uint8_t *buf, size_t len,
                                                int flags, void *user_data)
@@ -124,33 +151,95 @@ static int wslay_event_frame_genmask_callback(uint8_t *buf, size_t len,
   return e->ctx->callbacks.genmask_callback(e->ctx, buf, len, e->user_data);
 }
 
+/* Usable sizes of the recycled blocks. Larger allocations always use
+   malloc */
+static const size_t wslay_event_pool_class_size[WSLAY_EVENT_POOL_NUM_CLASSES] =
+  {64, 256, 1024, 4096};
+
+/* Maximum number of free blocks kept per size class. Fewer of the
+   large blocks are kept, so a burst leaves at most about 34KB behind */
+static const uint32_t wslay_event_pool_max_free[WSLAY_EVENT_POOL_NUM_CLASSES] =
+  {32, 32, 8, 4};
+
+static void* wslay_event_pool_alloc(wslay_event_context_ptr ctx, size_t size)
+{
+  union wslay_event_pool_header *h;
+  size_t c;
+  for(c = 0; c < WSLAY_EVENT_POOL_NUM_CLASSES; ++c) {
+    if(size <= wslay_event_pool_class_size[c]) {
+      break;
+    }
+  }
+  if(c < WSLAY_EVENT_POOL_NUM_CLASSES && ctx->pool.free_list[c]) {
+    h = ctx->pool.free_list[c];
+    ctx->pool.free_list[c] = h->next;
+    --ctx->pool.free_count[c];
+  } else {
+    size_t block_size = c < WSLAY_EVENT_POOL_NUM_CLASSES ?
+      wslay_event_pool_class_size[c] : size;
+    h = (union wslay_event_pool_header*)malloc(sizeof(*h)+block_size);
+    if(!h) {
+      return NULL;
+    }
+  }
+  h->size_class = c;
+  return h+1;
+}
+
+static void wslay_event_pool_free(wslay_event_context_ptr ctx, void *p)
+{
+  union wslay_event_pool_header *h;
+  size_t c;
+  if(!p) {
+    return;
+  }
+  h = (union wslay_event_pool_header*)p-1;
+  c = h->size_class;
+  if(c < WSLAY_EVENT_POOL_NUM_CLASSES &&
+     ctx->pool.free_count[c] < wslay_event_pool_max_free[c]) {
+    h->next = ctx->pool.free_list[c];
+    ctx->pool.free_list[c] = h;
+    ++ctx->pool.free_count[c];
+  } else {
+    free(h);
+  }
+}
+
+static void wslay_event_pool_clear(wslay_event_context_ptr ctx)
+{
+  size_t c;
+  for(c = 0; c < WSLAY_EVENT_POOL_NUM_CLASSES; ++c) {
+    while(ctx->pool.free_list[c]) {
+      union wslay_event_pool_header *h = ctx->pool.free_list[c];
+      ctx->pool.free_list[c] = h->next;
+      free(h);
+    }
+    ctx->pool.free_count[c] = 0;
+  }
+}
+
+/* The chunk data follows the chunk in the same allocation */
 static int wslay_event_byte_chunk_init
-(struct wslay_event_byte_chunk **chunk, size_t len)
+(wslay_event_context_ptr ctx, struct wslay_event_byte_chunk **chunk,
+ size_t len)
 {
-  *chunk = (struct wslay_event_byte_chunk*)malloc
-    (sizeof(struct wslay_event_byte_chunk));
+  *chunk = (struct wslay_event_byte_chunk*)wslay_event_pool_alloc
+    (ctx, sizeof(struct wslay_event_byte_chunk)+len);
   if(*chunk == NULL) {
     return WSLAY_ERR_NOMEM;
   }
   memset(*chunk, 0, sizeof(struct wslay_event_byte_chunk));
   if(len) {
-    (*chunk)->data = (uint8_t*)malloc(len);
-    if((*chunk)->data == NULL) {
-      free(*chunk);
-      return WSLAY_ERR_NOMEM;
-    }
+    (*chunk)->data = (uint8_t*)(*chunk+1);
     (*chunk)->data_length = len;
   }
   return 0;
 }
 
-static void wslay_event_byte_chunk_free(struct wslay_event_byte_chunk *c)
+static void wslay_event_byte_chunk_free(wslay_event_context_ptr ctx,
+                                        struct wslay_event_byte_chunk *c)
 {
-  if(!c) {
-    return;
-  }
-  free(c->data);
-  free(c);
+  wslay_event_pool_free(ctx, c);
 }
 
 static void wslay_event_byte_chunk_copy(struct wslay_event_byte_chunk *c,
@@ -169,35 +258,40 @@ static void wslay_event_imsg_set(struct wslay_event_imsg *m,
   m->msg_length = 0;
 }
 
-static void wslay_event_imsg_chunks_free(struct wslay_event_imsg *m)
+static void wslay_event_imsg_chunks_free(wslay_event_context_ptr ctx,
+                                         struct wslay_event_imsg *m)
 {
   if(!m->chunks) {
     return;
   }
   while(!wslay_queue_empty(m->chunks)) {
-    wslay_event_byte_chunk_free((struct wslay_event_byte_chunk*)wslay_queue_top(m->chunks));
+    wslay_event_byte_chunk_free(ctx, (struct wslay_event_byte_chunk*)wslay_queue_top(m->chunks));
     wslay_queue_pop(m->chunks);
   }
 }
 
-static void wslay_event_imsg_reset(struct wslay_event_imsg *m)
+static void wslay_event_imsg_reset(wslay_event_context_ptr ctx,
+                                   struct wslay_event_imsg *m)
 {
   m->opcode = 0xffu;
   m->utf8state = UTF8_ACCEPT;
-  wslay_event_imsg_chunks_free(m);
+  wslay_event_imsg_chunks_free(ctx, m);
 }
 
-static int wslay_event_imsg_append_chunk(struct wslay_event_imsg *m, size_t len)
+static int wslay_event_imsg_append_chunk(wslay_event_context_ptr ctx,
+                                         struct wslay_event_imsg *m,
+                                         size_t len)
 {
   if(len == 0) {
     return 0;
   } else {
     int r;
     struct wslay_event_byte_chunk *chunk;
-    if((r = wslay_event_byte_chunk_init(&chunk, len)) != 0) {
+    if((r = wslay_event_byte_chunk_init(ctx, &chunk, len)) != 0) {
       return r;
     }
     if((r = wslay_queue_push(m->chunks, chunk)) != 0) {
+      wslay_event_byte_chunk_free(ctx, chunk);
       return r;
     }
     m->msg_length += len;
@@ -205,11 +299,13 @@ static int wslay_event_imsg_append_chunk(struct wslay_event_imsg *m, size_t len)
   }
 }
 
+/* The copy of the message follows the omsg in the same allocation */
 static int wslay_event_omsg_non_fragmented_init
-(struct wslay_event_omsg **m, uint8_t opcode, uint8_t rsv,
- const uint8_t *msg, size_t msg_length)
+(wslay_event_context_ptr ctx, struct wslay_event_omsg **m, uint8_t opcode,
+ uint8_t rsv, const uint8_t *msg, size_t msg_length)
 {
-  *m = (struct wslay_event_omsg*)malloc(sizeof(struct wslay_event_omsg));
+  *m = (struct wslay_event_omsg*)wslay_event_pool_alloc
+    (ctx, sizeof(struct wslay_event_omsg)+msg_length);
   if(!*m) {
     return WSLAY_ERR_NOMEM;
   }
@@ -219,11 +315,7 @@ static int wslay_event_omsg_non_fragmented_init
   (*m)->rsv = rsv;
   (*m)->type = WSLAY_NON_FRAGMENTED;
   if(msg_length) {
-    (*m)->data = (uint8_t*)malloc(msg_length);
-    if(!(*m)->data) {
-      free(*m);
-      return WSLAY_ERR_NOMEM;
-    }
+    (*m)->data = (uint8_t*)(*m+1);
     memcpy((*m)->data, msg, msg_length);
     (*m)->data_length = msg_length;
   }
@@ -231,11 +323,12 @@ static int wslay_event_omsg_non_fragmented_init
 }
 
 static int wslay_event_omsg_fragmented_init
-(struct wslay_event_omsg **m, uint8_t opcode, uint8_t rsv,
- const union wslay_event_msg_source source,
+(wslay_event_context_ptr ctx, struct wslay_event_omsg **m, uint8_t opcode,
+ uint8_t rsv, const union wslay_event_msg_source source,
  wslay_event_fragmented_msg_callback read_callback)
 {
-  *m = (struct wslay_event_omsg*)malloc(sizeof(struct wslay_event_omsg));
+  *m = (struct wslay_event_omsg*)wslay_event_pool_alloc
+    (ctx, sizeof(struct wslay_event_omsg));
   if(!*m) {
     return WSLAY_ERR_NOMEM;
   }
@@ -248,22 +341,22 @@ static int wslay_event_omsg_fragmented_init
   return 0;
 }
 
-static void wslay_event_omsg_free(struct wslay_event_omsg *m)
+static void wslay_event_omsg_free(wslay_event_context_ptr ctx,
+                                  struct wslay_event_omsg *m)
 {
-  if(!m) {
-    return;
-  }
-  free(m->data);
-  free(m);
+  wslay_event_pool_free(ctx, m);
 }
 
-static uint8_t* wslay_event_flatten_queue(struct wslay_queue *queue, size_t len)
+/* The result is freed with wslay_event_pool_free() */
+static uint8_t* wslay_event_flatten_queue(wslay_event_context_ptr ctx,
+                                          struct wslay_queue *queue,
+                                          size_t len)
 {
   if(len == 0) {
     return NULL;
   } else {
     size_t off = 0;
-    uint8_t *buf = (uint8_t*)malloc(len);
+    uint8_t *buf = (uint8_t*)wslay_event_pool_alloc(ctx, len);
     if(!buf) {
       return NULL;
     }
@@ -271,7 +364,7 @@ static uint8_t* wslay_event_flatten_queue(struct wslay_queue *queue, size_t len)
       struct wslay_event_byte_chunk *chunk = (struct wslay_event_byte_chunk *)wslay_queue_top(queue);
       memcpy(buf+off, chunk->data, chunk->data_length);
       off += chunk->data_length;
-      wslay_event_byte_chunk_free(chunk);
+      wslay_event_byte_chunk_free(ctx, chunk);
       wslay_queue_pop(queue);
       assert(off <= len);
     }
@@ -358,7 +451,7 @@ int wslay_event_queue_msg_ex(wslay_event_context_ptr ctx,
     return WSLAY_ERR_INVALID_ARGUMENT;
   }
   if((r = wslay_event_omsg_non_fragmented_init
-      (&omsg, arg->opcode, rsv, arg->msg, arg->msg_length)) != 0) {
+      (ctx, &omsg, arg->opcode, rsv, arg->msg, arg->msg_length)) != 0) {
     return r;
   }
   if(wslay_is_ctrl_frame(arg->opcode)) {
@@ -394,7 +487,7 @@ int wslay_event_queue_fragmented_msg_ex(wslay_event_context_ptr ctx,
     return WSLAY_ERR_INVALID_ARGUMENT;
   }
   if((r = wslay_event_omsg_fragmented_init
-      (&omsg, arg->opcode, rsv, arg->source, arg->read_callback)) != 0) {
+      (ctx, &omsg, arg->opcode, rsv, arg->source, arg->read_callback)) != 0) {
     return r;
   }
   if((r = wslay_queue_push(ctx->send_queue, omsg)) != 0) {
@@ -449,7 +542,7 @@ static int wslay_event_context_init
   (*ctx)->queued_msg_count = 0;
   (*ctx)->queued_msg_length = 0;
   for(i = 0; i < 2; ++i) {
-    wslay_event_imsg_reset(&(*ctx)->imsgs[i]);
+    wslay_event_imsg_reset(*ctx, &(*ctx)->imsgs[i]);
     (*ctx)->imsgs[i].chunks = wslay_queue_new();
     if(!(*ctx)->imsgs[i].chunks) {
       wslay_event_context_free(*ctx);
@@ -457,6 +550,12 @@ static int wslay_event_context_init
     }
   }
   (*ctx)->imsg = &(*ctx)->imsgs[0];
+  (*ctx)->obuf = (uint8_t*)malloc(WSLAY_DEFAULT_BUFLEN);
+  if(!(*ctx)->obuf) {
+    wslay_event_context_free(*ctx);
+    return WSLAY_ERR_NOMEM;
+  }
+  (*ctx)->obuflen = WSLAY_DEFAULT_BUFLEN;
   (*ctx)->obufmark = (*ctx)->obuflimit = (*ctx)->obuf;
   (*ctx)->status_code_sent = WSLAY_CODE_ABNORMAL_CLOSURE;
   (*ctx)->status_code_recv = WSLAY_CODE_ABNORMAL_CLOSURE;
@@ -497,25 +596,27 @@ void wslay_event_context_free(wslay_event_context_ptr ctx)
     return;
   }
   for(i = 0; i < 2; ++i) {
-    wslay_event_imsg_chunks_free(&ctx->imsgs[i]);
+    wslay_event_imsg_chunks_free(ctx, &ctx->imsgs[i]);
     wslay_queue_free(ctx->imsgs[i].chunks);
   }
   if(ctx->send_queue) {
     while(!wslay_queue_empty(ctx->send_queue)) {
-      wslay_event_omsg_free((struct wslay_event_omsg *)wslay_queue_top(ctx->send_queue));
+      wslay_event_omsg_free(ctx, (struct wslay_event_omsg *)wslay_queue_top(ctx->send_queue));
       wslay_queue_pop(ctx->send_queue);
     }
     wslay_queue_free(ctx->send_queue);
   }
   if(ctx->send_ctrl_queue) {
     while(!wslay_queue_empty(ctx->send_ctrl_queue)) {
-      wslay_event_omsg_free((struct wslay_event_omsg *)wslay_queue_top(ctx->send_ctrl_queue));
+      wslay_event_omsg_free(ctx, (struct wslay_event_omsg *)wslay_queue_top(ctx->send_ctrl_queue));
       wslay_queue_pop(ctx->send_ctrl_queue);
     }
     wslay_queue_free(ctx->send_ctrl_queue);
   }
   wslay_frame_context_free(ctx->frame_ctx);
-  wslay_event_omsg_free(ctx->omsg);
+  wslay_event_omsg_free(ctx, ctx->omsg);
+  wslay_event_pool_clear(ctx);
+  free(ctx->obuf);
   free(ctx);
 }
 
@@ -569,6 +670,18 @@ int wslay_event_recv(wslay_event_context_ptr ctx)
   ssize_t r;
   while(ctx->read_enabled) {
     memset(&iocb, 0, sizeof(iocb));
+    /* The rest of a data frame may go straight to the user's buffer */
+    if(ctx->callbacks.recv_payload_buffer_callback &&
+       wslay_event_config_get_no_buffering(ctx) &&
+       ctx->ipayloadoff < ctx->ipayloadlen &&
+       !wslay_is_ctrl_frame(ctx->imsg->opcode)) {
+      size_t buflen = 0;
+      uint8_t *buf = ctx->callbacks.recv_payload_buffer_callback
+        (ctx, ctx->ipayloadlen-ctx->ipayloadoff, &buflen, ctx->user_data);
+      if(buf && buflen > 0) {
+        wslay_frame_set_payload_buffer(ctx->frame_ctx, buf, buflen);
+      }
+    }
     r = wslay_frame_recv(ctx->frame_ctx, &iocb);
     if(r >= 0) {
       int new_frame = 0;
@@ -628,7 +741,7 @@ int wslay_event_recv(wslay_event_context_ptr ctx)
         wslay_event_call_on_frame_recv_start_callback(ctx, &iocb);
         if(!wslay_event_config_get_no_buffering(ctx) ||
            wslay_is_ctrl_frame(iocb.opcode)) {
-          if((r = wslay_event_imsg_append_chunk(ctx->imsg,
+          if((r = wslay_event_imsg_append_chunk(ctx, ctx->imsg,
                                                 iocb.payload_length)) != 0) {
             ctx->read_enabled = 0;
             return r;
@@ -645,15 +758,15 @@ int wslay_event_recv(wslay_event_context_ptr ctx)
         } else {
           i = 0;
         }
-        for(; i < iocb.data_length; ++i) {
-          uint32_t codep;
-          if(decode(&ctx->imsg->utf8state, &codep,
-                    iocb.data[i]) == UTF8_REJECT) {
+        if(i < iocb.data_length) {
+          ctx->imsg->utf8state = validate_utf8(ctx->imsg->utf8state,
+                                               iocb.data + i,
+                                               iocb.data_length - i);
+          if(ctx->imsg->utf8state == UTF8_REJECT) {
             if((r = wslay_event_queue_close_wrapper
                 (ctx, WSLAY_CODE_INVALID_FRAME_PAYLOAD_DATA, NULL, 0)) != 0) {
               return r;
             }
-            break;
           }
         }
       }
@@ -693,7 +806,7 @@ int wslay_event_recv(wslay_event_context_ptr ctx)
             size_t msg_length = 0;
             if(!wslay_event_config_get_no_buffering(ctx) ||
                wslay_is_ctrl_frame(iocb.opcode)) {
-              msg = wslay_event_flatten_queue(ctx->imsg->chunks,
+              msg = wslay_event_flatten_queue(ctx, ctx->imsg->chunks,
                                               ctx->imsg->msg_length);
               if(ctx->imsg->msg_length && !msg) {
                 ctx->read_enabled = 0;
@@ -708,7 +821,7 @@ int wslay_event_recv(wslay_event_context_ptr ctx)
                 memcpy(&status_code, msg, 2);
                 status_code = ntohs(status_code);
                 if(!wslay_event_is_valid_status_code(status_code)) {
-                  free(msg);
+                  wslay_event_pool_free(ctx, msg);
                   if((r = wslay_event_queue_close_wrapper
                       (ctx, WSLAY_CODE_PROTOCOL_ERROR, NULL, 0)) != 0) {
                     return r;
@@ -726,7 +839,7 @@ int wslay_event_recv(wslay_event_context_ptr ctx)
                 status_code == 0 ? WSLAY_CODE_NO_STATUS_RCVD : status_code;
               if((r = wslay_event_queue_close_wrapper
                   (ctx, status_code, reason, reason_length)) != 0) {
-                free(msg);
+                wslay_event_pool_free(ctx, msg);
                 return r;
               }
             } else if(ctx->imsg->opcode == WSLAY_PING) {
@@ -737,7 +850,7 @@ int wslay_event_recv(wslay_event_context_ptr ctx)
               if((r = wslay_event_queue_msg(ctx, &pong_arg)) &&
                  r != WSLAY_ERR_NO_MORE_MSG) {
                 ctx->read_enabled = 0;
-                free(msg);
+                wslay_event_pool_free(ctx, msg);
                 return r;
               }
             }
@@ -750,9 +863,9 @@ int wslay_event_recv(wslay_event_context_ptr ctx)
               ctx->error = 0;
               ctx->callbacks.on_msg_recv_callback(ctx, &arg, ctx->user_data);
             }
-            free(msg);
+            wslay_event_pool_free(ctx, msg);
           }
-          wslay_event_imsg_reset(ctx->imsg);
+          wslay_event_imsg_reset(ctx, ctx->imsg);
           if(ctx->imsg == &ctx->imsgs[1]) {
             ctx->imsg = &ctx->imsgs[0];
           }
@@ -795,7 +908,7 @@ static struct wslay_event_omsg* wslay_event_send_ctrl_queue_pop
       if(msg->opcode == WSLAY_CONNECTION_CLOSE) {
         return msg;
       } else {
-        wslay_event_omsg_free(msg);
+        wslay_event_omsg_free(ctx, msg);
       }
     }
     return NULL;
@@ -866,7 +979,7 @@ int wslay_event_send(wslay_event_context_ptr ctx)
             ctx->status_code_sent =
               status_code == 0 ? WSLAY_CODE_NO_STATUS_RCVD : status_code;
           }
-          wslay_event_omsg_free(ctx->omsg);
+          wslay_event_omsg_free(ctx, ctx->omsg);
           ctx->omsg = NULL;
         } else {
           break;
@@ -882,7 +995,7 @@ int wslay_event_send(wslay_event_context_ptr ctx)
     } else {
       if(ctx->omsg->fin == 0 && ctx->obuflimit == ctx->obufmark) {
         int eof = 0;
-        r = ctx->omsg->read_callback(ctx, ctx->obuf, sizeof(ctx->obuf),
+        r = ctx->omsg->read_callback(ctx, ctx->obuf, ctx->obuflen,
                                      &ctx->omsg->source,
                                      &eof, ctx->user_data);
         if(r == 0 && eof == 0) {
@@ -913,7 +1026,7 @@ int wslay_event_send(wslay_event_context_ptr ctx)
           ctx->obufmark = ctx->obuflimit = ctx->obuf;
           if(ctx->omsg->fin) {
             --ctx->queued_msg_count;
-            wslay_event_omsg_free(ctx->omsg);
+            wslay_event_omsg_free(ctx, ctx->omsg);
             ctx->omsg = NULL;
           } else {
             ctx->omsg->opcode = WSLAY_CONTINUATION_FRAME;
@@ -991,6 +1104,11 @@ void wslay_event_config_set_allowed_rsv_bits(wslay_event_context_ptr ctx,
   ctx->allowed_rsv_bits = rsv & WSLAY_RSV1_BIT;
 }
 
+void wslay_event_trim_pool(wslay_event_context_ptr ctx)
+{
+  wslay_event_pool_clear(ctx);
+}
+
 void wslay_event_config_set_no_buffering(wslay_event_context_ptr ctx, int val)
 {
   if(val) {
@@ -1000,6 +1118,29 @@ void wslay_event_config_set_no_buffering(wslay_event_context_ptr ctx, int val)
   }
 }
 
+int wslay_event_config_set_buffer_sizes(wslay_event_context_ptr ctx,
+                                        size_t recv_buffer_size,
+                                        size_t send_buffer_size)
+{
+  uint8_t *obuf;
+  int r;
+  if(send_buffer_size == 0) {
+    return WSLAY_ERR_INVALID_ARGUMENT;
+  }
+  if((r = wslay_frame_set_recv_buffer_size(ctx->frame_ctx,
+                                           recv_buffer_size)) != 0) {
+    return r;
+  }
+  obuf = (uint8_t*)malloc(send_buffer_size);
+  if(!obuf) {
+    return WSLAY_ERR_NOMEM;
+  }
+  free(ctx->obuf);
+  ctx->obuf = ctx->obufmark = ctx->obuflimit = obuf;
+  ctx->obuflen = send_buffer_size;
+  return 0;
+}
+
 void wslay_event_config_set_max_recv_msg_length(wslay_event_context_ptr ctx,
                                                 uint64_t val)
 {
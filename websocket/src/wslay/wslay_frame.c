@@ -30,8 +30,66 @@
 
 #include "wslay_net.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define WSLAY_MASK_SSE2
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define WSLAY_MASK_NEON
+#  include <arm_neon.h>
+#endif
+
 #define wslay_min(A, B) (((A) < (B)) ? (A) : (B))
 
+/* Size of the stack buffer used for masking outgoing payload */
+#define WSLAY_MASK_BUFFER_SIZE 16384
+
+/*
+ * Masks len bytes from src into dst, which may be the same buffer. off
+ * is the payload offset of src[0], which selects where in the 4 byte
+ * key to start.
+ */
+static void wslay_mask_payload(uint8_t *dst, const uint8_t *src, size_t len,
+                               const uint8_t *maskkey, uint64_t off)
+{
+  uint8_t key[16];
+  size_t i = 0;
+  int k;
+  /* Rotate the key to start at off, then every multiple of 4 bytes lines
+     up with it */
+  for(k = 0; k < 16; ++k) {
+    key[k] = maskkey[(off+k)%4];
+  }
+#if defined(WSLAY_MASK_SSE2)
+  {
+    __m128i m = _mm_loadu_si128((const __m128i*)key);
+    for(; i+16 <= len; i += 16) {
+      __m128i d = _mm_loadu_si128((const __m128i*)(src+i));
+      _mm_storeu_si128((__m128i*)(dst+i), _mm_xor_si128(d, m));
+    }
+  }
+#elif defined(WSLAY_MASK_NEON)
+  {
+    uint8x16_t m = vld1q_u8(key);
+    for(; i+16 <= len; i += 16) {
+      vst1q_u8(dst+i, veorq_u8(vld1q_u8(src+i), m));
+    }
+  }
+#endif
+  {
+    uint64_t m;
+    memcpy(&m, key, 8);
+    for(; i+8 <= len; i += 8) {
+      uint64_t d;
+      memcpy(&d, src+i, 8);
+      d ^= m;
+      memcpy(dst+i, &d, 8);
+    }
+  }
+  for(; i < len; ++i) {
+    dst[i] = src[i]^key[i%4];
+  }
+}
+
 int wslay_frame_context_init(wslay_frame_context_ptr *ctx,
                              const struct wslay_frame_callbacks *callbacks,
                              void *user_data)
@@ -41,6 +99,12 @@ int wslay_frame_context_init(wslay_frame_context_ptr *ctx,
     return -1;
   }
   memset(*ctx, 0, sizeof(struct wslay_frame_context));
+  (*ctx)->ibuf = (uint8_t*)malloc(WSLAY_DEFAULT_BUFLEN);
+  if((*ctx)->ibuf == NULL) {
+    free(*ctx);
+    return -1;
+  }
+  (*ctx)->ibuflen = WSLAY_DEFAULT_BUFLEN;
   (*ctx)->istate = RECV_HEADER1;
   (*ctx)->ireqread = 2;
   (*ctx)->ostate = PREP_HEADER;
@@ -52,9 +116,39 @@ int wslay_frame_context_init(wslay_frame_context_ptr *ctx,
 
 void wslay_frame_context_free(wslay_frame_context_ptr ctx)
 {
+  if(ctx) {
+    free(ctx->ibuf);
+  }
   free(ctx);
 }
 
+int wslay_frame_set_recv_buffer_size(wslay_frame_context_ptr ctx,
+                                     size_t size)
+{
+  uint8_t *ibuf;
+  size_t len = ctx->ibuflimit-ctx->ibufmark;
+  if(size < 14 || size < len) {
+    return WSLAY_ERR_INVALID_ARGUMENT;
+  }
+  ibuf = (uint8_t*)malloc(size);
+  if(ibuf == NULL) {
+    return WSLAY_ERR_NOMEM;
+  }
+  memcpy(ibuf, ctx->ibufmark, len);
+  free(ctx->ibuf);
+  ctx->ibuf = ctx->ibufmark = ibuf;
+  ctx->ibuflimit = ibuf+len;
+  ctx->ibuflen = size;
+  return 0;
+}
+
+void wslay_frame_set_payload_buffer(wslay_frame_context_ptr ctx,
+                                    uint8_t *buf, size_t len)
+{
+  ctx->ipayloadbuf = buf;
+  ctx->ipayloadbuflen = len;
+}
+
 ssize_t wslay_frame_send(wslay_frame_context_ptr ctx,
                          struct wslay_frame_iocb *iocb)
 {
@@ -135,7 +229,7 @@ ssize_t wslay_frame_send(wslay_frame_context_ptr ctx,
     size_t totallen = 0;
     if(iocb->data_length > 0) {
       if(ctx->omask) {
-        uint8_t temp[4096];
+        uint8_t temp[WSLAY_MASK_BUFFER_SIZE];
         const uint8_t *datamark = iocb->data,
           *datalimit = iocb->data+iocb->data_length;
         while(datamark < datalimit) {
@@ -144,10 +238,8 @@ ssize_t wslay_frame_send(wslay_frame_context_ptr ctx,
             wslay_min(sizeof(temp), datalen);
           size_t writelen = writelimit-datamark;
           ssize_t r;
-          size_t i;
-          for(i = 0; i < writelen; ++i) {
-            temp[i] = datamark[i]^ctx->omaskkey[(ctx->opayloadoff+i)%4];
-          }
+          wslay_mask_payload(temp, datamark, writelen, ctx->omaskkey,
+                             ctx->opayloadoff);
           r = ctx->callbacks.send_callback(temp, writelen, 0, ctx->user_data);
           if(r > 0) {
             if((size_t)r > writelen) {
@@ -204,7 +296,7 @@ static ssize_t wslay_recv(wslay_frame_context_ptr ctx)
     wslay_shift_ibuf(ctx);
   }
   r = ctx->callbacks.recv_callback
-    (ctx->ibuflimit, ctx->ibuf+sizeof(ctx->ibuf)-ctx->ibuflimit,
+    (ctx->ibuflimit, ctx->ibuf+ctx->ibuflen-ctx->ibuflimit,
      0, ctx->user_data);
   if(r > 0) {
     ctx->ibuflimit += r;
@@ -220,6 +312,10 @@ ssize_t wslay_frame_recv(wslay_frame_context_ptr ctx,
                          struct wslay_frame_iocb *iocb)
 {
   ssize_t r;
+  uint8_t *payloadbuf = ctx->ipayloadbuf;
+  size_t payloadbuflen = ctx->ipayloadbuflen;
+  ctx->ipayloadbuf = NULL;
+  ctx->ipayloadbuflen = 0;
   if(ctx->istate == RECV_HEADER1) {
     uint8_t fin, opcode, rsv, payloadlen;
     if(WSLAY_AVAIL_IBUF(ctx) < ctx->ireqread) {
@@ -306,30 +402,39 @@ ssize_t wslay_frame_recv(wslay_frame_context_ptr ctx,
   if(ctx->istate == RECV_PAYLOAD) {
     uint8_t *readlimit, *readmark;
     uint64_t rempayloadlen = ctx->ipayloadlen-ctx->ipayloadoff;
-    if(WSLAY_AVAIL_IBUF(ctx) == 0 && rempayloadlen > 0) {
-      if((r = wslay_recv(ctx)) <= 0) {
-        return r;
-      }
-    }
-    readmark = ctx->ibufmark;
-    readlimit = WSLAY_AVAIL_IBUF(ctx) < rempayloadlen ?
-      ctx->ibuflimit : ctx->ibufmark+rempayloadlen;
-    if(ctx->imask) {
-      for(; ctx->ibufmark != readlimit;
-          ++ctx->ibufmark, ++ctx->ipayloadoff) {
-        ctx->ibufmark[0] ^= ctx->imaskkey[ctx->ipayloadoff % 4];
+    if(WSLAY_AVAIL_IBUF(ctx) == 0 && rempayloadlen > 0 && payloadbuf) {
+      /* Skip ibuf, and read straight into the caller's buffer */
+      size_t len = payloadbuflen < rempayloadlen ?
+        payloadbuflen : (size_t)rempayloadlen;
+      r = ctx->callbacks.recv_callback(payloadbuf, len, 0, ctx->user_data);
+      if(r <= 0) {
+        return WSLAY_ERR_WANT_READ;
       }
+      readmark = payloadbuf;
+      readlimit = payloadbuf+r;
     } else {
+      if(WSLAY_AVAIL_IBUF(ctx) == 0 && rempayloadlen > 0) {
+        if((r = wslay_recv(ctx)) <= 0) {
+          return r;
+        }
+      }
+      readmark = ctx->ibufmark;
+      readlimit = WSLAY_AVAIL_IBUF(ctx) < rempayloadlen ?
+        ctx->ibuflimit : ctx->ibufmark+rempayloadlen;
       ctx->ibufmark = readlimit;
-      ctx->ipayloadoff += readlimit-readmark;
     }
+    if(ctx->imask) {
+      wslay_mask_payload(readmark, readmark, readlimit-readmark,
+                         ctx->imaskkey, ctx->ipayloadoff);
+    }
+    ctx->ipayloadoff += readlimit-readmark;
     iocb->fin = ctx->iom.fin;
     iocb->rsv = ctx->iom.rsv;
     iocb->opcode = ctx->iom.opcode;
     iocb->payload_length = ctx->ipayloadlen;
     iocb->mask = ctx->imask;
     iocb->data = readmark;
-    iocb->data_length = ctx->ibufmark-readmark;
+    iocb->data_length = readlimit-readmark;
     if(ctx->ipayloadlen == ctx->ipayloadoff) {
       ctx->istate = RECV_HEADER1;
       ctx->ireqread = 2;
@@ -2,6 +2,9 @@
 
 #if defined(HAVE_WSLAY)
 
+#include <wslay/wslay_event.h>
+#include <wslay/wslay_frame.h>
+
 namespace dmWebsocket
 {
 
@@ -9,10 +12,11 @@ const struct wslay_event_callbacks g_WslCallbacks = {
     WSL_RecvCallback,
     WSL_SendCallback,
     WSL_GenmaskCallback,
+    WSL_OnFrameRecvStartCallback,
+    WSL_OnFrameRecvChunkCallback,
     NULL,
-    NULL,
-    NULL,
-    WSL_OnMsgRecvCallback
+    WSL_OnMsgRecvCallback,
+    WSL_RecvPayloadBufferCallback
 };
 
 #define WSLAY_CASE(_X) case _X: return #_X;
@@ -36,13 +40,26 @@ const char* WSL_ResultToString(int err)
 #undef WSLAY_CASE
 
 
-int WSL_Init(wslay_event_context_ptr* ctx, ssize_t buffer_size, void* userctx)
+int WSL_Init(wslay_event_context_ptr* ctx, ssize_t buffer_size, uint32_t recv_buffer_size, uint32_t send_buffer_size, void* userctx, bool server)
 {
-    // Currently only supports client implementation
+    // A server doesn't mask its frames, and requires the client's frames to be masked
     int ret = -1;
-    ret = wslay_event_context_client_init(ctx, &g_WslCallbacks, userctx);
+    if (server)
+        ret = wslay_event_context_server_init(ctx, &g_WslCallbacks, userctx);
+    else
+        ret = wslay_event_context_client_init(ctx, &g_WslCallbacks, userctx);
     if (ret == 0)
+    {
         wslay_event_config_set_max_recv_msg_length(*ctx, buffer_size);
+        // We gather the data messages ourselves, see WSL_OnFrameRecvChunkCallback()
+        wslay_event_config_set_no_buffering(*ctx, 1);
+        ret = wslay_event_config_set_buffer_sizes(*ctx, recv_buffer_size, send_buffer_size);
+        if (ret != 0)
+        {
+            wslay_event_context_free(*ctx);
+            *ctx = 0;
+        }
+    }
     return ret;
 }
 
@@ -59,15 +76,48 @@ int WSL_Close(wslay_event_context_ptr ctx)
     return 0;
 }
 
-int WSL_Poll(wslay_event_context_ptr ctx)
+// Writes as much of the corked frames as the socket takes
+static dmSocket::Result FlushCork(WebsocketConnection* conn)
+{
+    if (conn->m_CorkSize == 0)
+        return dmSocket::RESULT_OK;
+
+    int sent_bytes = 0;
+    dmSocket::Result r = Send(conn, conn->m_CorkBuffer, conn->m_CorkSize, &sent_bytes);
+    memmove(conn->m_CorkBuffer, conn->m_CorkBuffer + sent_bytes, conn->m_CorkSize - sent_bytes);
+    conn->m_CorkSize -= sent_bytes;
+    return r;
+}
+
+int WSL_Poll(wslay_event_context_ptr ctx, bool recv)
 {
+    WebsocketConnection* conn = (WebsocketConnection*)ctx->user_data;
     int r = 0;
-    if ((r = wslay_event_recv(ctx)) != 0 || (r = wslay_event_send(ctx)) != 0) {
+    if ((recv && (r = wslay_event_recv(ctx)) != 0) || (wslay_event_want_write(ctx) && (r = wslay_event_send(ctx)) != 0)) {
+        dmLogError("Websocket poll error: %s", WSL_ResultToString(r));
+        return r;
+    }
+
+    // The frames queued during this update go out in a single write
+    dmSocket::Result sr = FlushCork(conn);
+    if (sr != dmSocket::RESULT_OK && sr != dmSocket::RESULT_WOULDBLOCK) {
+        r = WSLAY_ERR_CALLBACK_FAILURE;
         dmLogError("Websocket poll error: %s", WSL_ResultToString(r));
     }
     return r;
 }
 
+void WSL_FlushCork(wslay_event_context_ptr ctx, uint64_t timeout)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)ctx->user_data;
+    if (conn->m_CorkSize == 0)
+        return;
+
+    // There's no later poll to write the rest, so this waits for the socket. A dead socket fails right away
+    SendAll(conn, conn->m_CorkBuffer, (int)conn->m_CorkSize, timeout);
+    conn->m_CorkSize = 0;
+}
+
 int WSL_WantsExit(wslay_event_context_ptr ctx)
 {
     if ((wslay_event_get_close_sent(ctx) && wslay_event_get_close_received(ctx))) {
@@ -80,6 +130,26 @@ ssize_t WSL_RecvCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len,
 {
     WebsocketConnection* conn = (WebsocketConnection*)user_data;
 
+    // Don't read more until the script side has caught up, so the received data doesn't pile up,
+    // or once the time for this update is up. The socket isn't drained, so the next poll reads again
+    if (!conn->m_InboundPending.Empty() || (conn->m_RecvDeadline && dmTime::GetTime() >= conn->m_RecvDeadline))
+    {
+        wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+        return -1;
+    }
+
+    // Data received together with the handshake comes first
+    if (conn->m_BufferSize > 0)
+    {
+        size_t size = (size_t)conn->m_BufferSize < len ? (size_t)conn->m_BufferSize : len;
+        memcpy(buf, conn->m_Buffer, size);
+        memmove(conn->m_Buffer, conn->m_Buffer + size, conn->m_BufferSize - size);
+        conn->m_BufferSize -= (int)size;
+        if (conn->m_BufferSize == 0)
+            FitBuffer(conn);
+        return (ssize_t)size;
+    }
+
     int r = -1; // received bytes if >=0, error if < 0
 
     dmSocket::Result socket_result = Receive(conn, buf, len, &r);
@@ -90,12 +160,14 @@ ssize_t WSL_RecvCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len,
     if (dmSocket::RESULT_OK != socket_result)
     {
         if (socket_result == dmSocket::RESULT_WOULDBLOCK || socket_result == dmSocket::RESULT_TRY_AGAIN) {
+            conn->m_RecvDrained = 1;
             wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
         }
         else
             wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
         return -1;
     }
+    conn->m_RecvDrained = 0;
     return r;
 }
 
@@ -103,12 +175,44 @@ ssize_t WSL_SendCallback(wslay_event_context_ptr ctx, const uint8_t *data, size_
 {
     WebsocketConnection* conn = (WebsocketConnection*)user_data;
 
+    // Corked frames are gathered, and written at the end of WSL_Poll(). The buffer holds one tls record.
+    // Without the buffer, the frames are written directly
+    if (conn->m_Cork && !conn->m_CorkBuffer)
+        conn->m_CorkBuffer = (char*)malloc(CORK_BUFFER_SIZE);
+    if (conn->m_Cork && conn->m_CorkBuffer)
+    {
+        if (conn->m_CorkSize + len > CORK_BUFFER_SIZE)
+        {
+            dmSocket::Result r = FlushCork(conn);
+            if (r != dmSocket::RESULT_OK && r != dmSocket::RESULT_WOULDBLOCK)
+            {
+                wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
+                return -1;
+            }
+        }
+
+        if (conn->m_CorkSize + len <= CORK_BUFFER_SIZE)
+        {
+            memcpy(conn->m_CorkBuffer + conn->m_CorkSize, data, len);
+            conn->m_CorkSize += len;
+            return (ssize_t)len;
+        }
+
+        // Bigger than the buffer, it's written directly once the buffer is empty
+        if (conn->m_CorkSize > 0)
+        {
+            wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+            return -1;
+        }
+    }
+
+    // A partial write is fine, wslay keeps the rest and continues on the next poll
     int sent_bytes = 0;
     dmSocket::Result socket_result = Send(conn, (const char*)data, len, &sent_bytes);
 
     if (socket_result != dmSocket::RESULT_OK)
     {
-        if (socket_result == dmSocket::RESULT_WOULDBLOCK || socket_result == dmSocket::RESULT_TRY_AGAIN)
+        if (socket_result == dmSocket::RESULT_WOULDBLOCK)
             wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
         else
             wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
@@ -117,17 +221,226 @@ ssize_t WSL_SendCallback(wslay_event_context_ptr ctx, const uint8_t *data, size_
     return (ssize_t)sent_bytes;
 }
 
+// Data messages are copied from the frame buffer straight into the message that goes to the script side.
+// A message is allocated with the size of its first frame, and only grows if there are more fragments.
+
+// Gives up on the message being received. The rest of it is skipped, and the connection closed with 1009
+static void DiscardMessage(wslay_event_context_ptr ctx, WebsocketConnection* conn)
+{
+    conn->m_RecvDiscard = 1;
+    wslay_event_queue_close(ctx, WSLAY_CODE_MESSAGE_TOO_BIG, 0, 0);
+}
+
+// Returns false if out of memory, and the message is discarded
+static bool ReserveRecvMessage(wslay_event_context_ptr ctx, WebsocketConnection* conn, uint32_t capacity)
+{
+    Message* msg = ResizeMessage(conn->m_RecvMessage, capacity);
+    if (!msg)
+    {
+        dmLogError("Out of memory receiving a message of %u bytes", capacity);
+        DiscardMessage(ctx, conn);
+        return false;
+    }
+    conn->m_RecvMessage = msg;
+    conn->m_RecvCapacity = capacity;
+    return true;
+}
+
+void WSL_OnFrameRecvStartCallback(wslay_event_context_ptr ctx, const struct wslay_event_on_frame_recv_start_arg *arg, void *user_data)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)user_data;
+
+    ++conn->m_Stats.m_FramesReceived;
+    HandleInbound(conn);
+
+    // wslay buffers the control frames (which may arrive in between the fragments of a message)
+    conn->m_RecvControlFrame = (arg->opcode & 0x8) ? 1 : 0;
+    if (conn->m_RecvControlFrame || conn->m_RecvDiscard)
+        return;
+
+    conn->m_RecvInMessage = 1;
+    uint32_t size = 0;
+    if (arg->opcode != WSLAY_CONTINUATION_FRAME)
+    {
+        if (conn->m_RecvMessage)
+            conn->m_RecvMessage->m_Length = 0;
+        conn->m_RecvCompressed = wslay_get_rsv1(arg->rsv) ? 1 : 0;
+        conn->m_RecvChunked = 0;
+    }
+    else if (conn->m_RecvMessage)
+    {
+        size = conn->m_RecvMessage->m_Length;
+    }
+
+    // A streamed message only needs room for one chunk, or less if the message is smaller.
+    // Compressed messages are inflated as a whole
+    if (conn->m_ChunkSize && !conn->m_RecvCompressed)
+    {
+        conn->m_RecvFrameRemaining = arg->payload_length;
+        uint64_t required = size + arg->payload_length;
+        uint32_t capacity = required < conn->m_ChunkSize ? (uint32_t)required : conn->m_ChunkSize;
+        if (conn->m_RecvCapacity < capacity)
+            ReserveRecvMessage(ctx, conn, capacity);
+        return;
+    }
+
+    // wslay doesn't check the length when it isn't buffering the message, so the header of a frame
+    // mustn't make us allocate more than the largest message we take
+    uint64_t required = size + arg->payload_length;
+    if (required > conn->m_MaxMessageSize)
+    {
+        dmLogError("Received message is too big: %llu bytes (max %u)", (unsigned long long)required, conn->m_MaxMessageSize);
+        DiscardMessage(ctx, conn);
+        return;
+    }
+
+    if (required > conn->m_RecvCapacity)
+    {
+        // More fragments may follow, so leave some room for them
+        uint32_t capacity = (uint32_t)required;
+        if (!arg->fin && conn->m_RecvCapacity * 2 > capacity)
+            capacity = conn->m_RecvCapacity * 2 < conn->m_MaxMessageSize ? conn->m_RecvCapacity * 2 : conn->m_MaxMessageSize;
+        ReserveRecvMessage(ctx, conn, capacity);
+    }
+}
+
+// How far the message being received can be filled. A streamed message stops at the end of the chunk,
+// even if the message was grown for an earlier compressed one
+static uint32_t RecvLimit(WebsocketConnection* conn)
+{
+    if (conn->m_ChunkSize && !conn->m_RecvCompressed && conn->m_RecvCapacity > conn->m_ChunkSize)
+        return conn->m_ChunkSize;
+    return conn->m_RecvCapacity;
+}
+
+// The rest of a big frame is read from the socket straight into the message, skipping the wslay frame buffer.
+// A payload that would fit in the frame buffer anyway is left to it, so small messages still take one read
+uint8_t* WSL_RecvPayloadBufferCallback(wslay_event_context_ptr ctx, uint64_t len, size_t* buflen, void* user_data)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)user_data;
+    Message* msg = conn->m_RecvMessage;
+    if (conn->m_RecvControlFrame || conn->m_RecvDiscard || !msg || len < ctx->frame_ctx->ibuflen)
+        return 0;
+
+    uint32_t space = RecvLimit(conn) - msg->m_Length;
+    if (space < ctx->frame_ctx->ibuflen)
+        return 0;
+    *buflen = space;
+    return (uint8_t*)GetMessageData(msg) + msg->m_Length;
+}
+
+// Hands a full chunk of a streamed message to the script side, and starts the next one with room for
+// what's left of the frame, up to a chunk. Returns false if out of memory, and the message is discarded
+static bool PushChunk(wslay_event_context_ptr ctx, WebsocketConnection* conn)
+{
+    Message* msg = conn->m_RecvMessage;
+    msg->m_Event = EVENT_MESSAGE_CHUNK;
+    ((char*)GetMessageData(msg))[msg->m_Length] = 0;
+    PushMessage(conn, msg);
+
+    conn->m_RecvMessage = 0;
+    conn->m_RecvCapacity = 0;
+    conn->m_RecvChunked = 1;
+    uint64_t remaining = conn->m_RecvFrameRemaining;
+    return ReserveRecvMessage(ctx, conn, remaining < conn->m_ChunkSize ? (uint32_t)remaining : conn->m_ChunkSize);
+}
+
+void WSL_OnFrameRecvChunkCallback(wslay_event_context_ptr ctx, const struct wslay_event_on_frame_recv_chunk_arg *arg, void *user_data)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)user_data;
+    if (conn->m_RecvControlFrame || conn->m_RecvDiscard || arg->data_length == 0)
+        return;
+
+    if (conn->m_ChunkSize && !conn->m_RecvCompressed)
+    {
+        const uint8_t* data = arg->data;
+        size_t remaining = arg->data_length;
+        while (remaining > 0)
+        {
+            // A full chunk is only handed over once more data follows, so the last part goes with EVENT_MESSAGE_END
+            if (conn->m_RecvMessage->m_Length == conn->m_ChunkSize && !PushChunk(ctx, conn))
+                return;
+
+            // The capacity holds the rest of the frame, or reaches the end of the chunk
+            Message* msg = conn->m_RecvMessage;
+            uint32_t space = RecvLimit(conn) - msg->m_Length;
+            uint32_t size = remaining < space ? (uint32_t)remaining : space;
+            char* dest = (char*)GetMessageData(msg) + msg->m_Length;
+            if ((const char*)data != dest)
+                memcpy(dest, data, size);
+            msg->m_Length += size;
+            data += size;
+            remaining -= size;
+            conn->m_RecvFrameRemaining -= size;
+        }
+        return;
+    }
+
+    // The capacity was reserved for the whole frame when it started. A direct read is already in place
+    Message* msg = conn->m_RecvMessage;
+    char* dest = (char*)GetMessageData(msg) + msg->m_Length;
+    if ((const char*)arg->data != dest)
+        memcpy(dest, arg->data, arg->data_length);
+    msg->m_Length += (uint32_t)arg->data_length;
+}
+
 void WSL_OnMsgRecvCallback(wslay_event_context_ptr ctx, const struct wslay_event_on_msg_recv_arg *arg, void *user_data)
 {
     WebsocketConnection* conn = (WebsocketConnection*)user_data;
     if (arg->opcode == WSLAY_TEXT_FRAME || arg->opcode == WSLAY_BINARY_FRAME)
     {
-        if (arg->msg_length >= conn->m_BufferCapacity)
-            conn->m_Buffer = (char*)realloc(conn->m_Buffer, arg->msg_length + 1);
-        memcpy(conn->m_Buffer, arg->msg, arg->msg_length);
-        conn->m_BufferSize = arg->msg_length;
-        conn->m_HasMessage = 1;
+        if (conn->m_RecvDiscard)
+            return;
+
+        conn->m_RecvInMessage = 0;
+        ++conn->m_Stats.m_MessagesReceived;
+
+        Message* msg = conn->m_RecvMessage;
+        if (!msg)
+        {
+            // An empty message
+            PushEvent(conn, EVENT_MESSAGE, 0, 0);
+            return;
+        }
+
+#if defined(HAVE_ZLIB)
+        if (wslay_get_rsv1(arg->rsv))
+        {
+            // The compressed data stays in the receive message, which is reused for the next one
+            const uint8_t* data;
+            uint32_t data_length;
+            int close_code = DeflateDecompress(conn, GetMessageData(msg), msg->m_Length, &data, &data_length);
+            if (close_code)
+            {
+                dmLogError("Failed to decompress message: %d", close_code);
+                conn->m_RecvDiscard = 1;
+                wslay_event_queue_close(ctx, close_code, 0, 0);
+                return;
+            }
+            // wslay can't validate the text before it's inflated
+            if (arg->opcode == WSLAY_TEXT_FRAME && !wslay_event_validate_utf8(data, data_length))
+            {
+                dmLogError("Received compressed text message isn't valid UTF-8");
+                conn->m_RecvDiscard = 1;
+                wslay_event_queue_close(ctx, WSLAY_CODE_INVALID_FRAME_PAYLOAD_DATA, 0, 0);
+                return;
+            }
+            if (!PushEvent(conn, EVENT_MESSAGE, data, data_length))
+                DiscardMessage(ctx, conn);
+            return;
+        }
+#endif
 
+        // Hand the message over as is. A single wslay_event_recv() may complete several messages, so we queue them all
+        msg->m_Event = conn->m_RecvChunked ? EVENT_MESSAGE_END : EVENT_MESSAGE;
+        ((char*)GetMessageData(msg))[msg->m_Length] = 0;
+        PushMessage(conn, msg);
+        conn->m_RecvMessage = 0;
+        conn->m_RecvCapacity = 0;
+
+    } else if (arg->opcode == WSLAY_PONG)
+    {
+        HandlePong(conn, arg->msg, (uint32_t)arg->msg_length);
     } else if (arg->opcode == WSLAY_CONNECTION_CLOSE)
     {
         // TODO: Store the reason
@@ -137,12 +450,60 @@ void WSL_OnMsgRecvCallback(wslay_event_context_ptr ctx, const struct wslay_event
 // ************************************************************************************************
 
 
-int WSL_GenmaskCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, void *user_data) {
-    pcg32_random_t rnd;
-    pcg32_srandom_r(&rnd, dmTime::GetTime(), 31452);
-    for (unsigned int i = 0; i < len; i++) {
-        buf[i] = (uint8_t)(pcg32_random_r(&rnd) & 0xFF);
+// Reads the next fragment of a buffer being sent (see QueueSendSource)
+ssize_t WSL_ReadSendSourceCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, const union wslay_event_msg_source *source, int *eof, void *user_data)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)user_data;
+    SendSource* send_source = (SendSource*)source->data;
+
+    uint32_t remaining = send_source->m_Size - send_source->m_Offset;
+    uint32_t size = len < remaining ? (uint32_t)len : remaining;
+    memcpy(buf, send_source->m_Data + send_source->m_Offset, size);
+    send_source->m_Offset += size;
+    conn->m_SendSourceBytes -= size;
+
+    if (send_source->m_Offset == send_source->m_Size)
+    {
+        // The last fragment is in the wslay buffer, and the source isn't read again
+        *eof = 1;
+        for (uint32_t i = 0; i < conn->m_QueuedSources.Size(); ++i)
+        {
+            if (conn->m_QueuedSources[i] == send_source)
+            {
+                conn->m_QueuedSources.EraseSwap(i);
+                break;
+            }
+        }
+        dmAtomicStore32(&send_source->m_Done, 1);
+    }
+    return (ssize_t)size;
+}
+
+// Reads the next fragment of a low priority message (see FeedLowPriority)
+ssize_t WSL_ReadLowPriorityCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, const union wslay_event_msg_source *source, int *eof, void *user_data)
+{
+    WebsocketConnection* conn = (WebsocketConnection*)user_data;
+    Message* msg = (Message*)source->data;
+
+    uint32_t remaining = msg->m_Length - conn->m_LowOffset;
+    uint32_t size = len < remaining ? (uint32_t)len : remaining;
+    memcpy(buf, GetMessageData(msg) + conn->m_LowOffset, size);
+    conn->m_LowOffset += size;
+    conn->m_LowPriorityBytes -= size;
+
+    if (conn->m_LowOffset == msg->m_Length)
+    {
+        // The last fragment is in the wslay buffer, and the message isn't read again
+        *eof = 1;
+        FreeMessage(msg);
+        conn->m_LowMessage = 0;
     }
+    return (ssize_t)size;
+}
+
+int WSL_GenmaskCallback(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, void *user_data) {
+    WebsocketConnection* conn = (WebsocketConnection*)user_data;
+    pcg32_random_bytes_r(&conn->m_Rnd, buf, (uint32_t)len); // A mask is 4 bytes, a single draw
     return 0;
 }
 